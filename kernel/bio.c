@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a set of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -22,70 +22,337 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "bstat.h"
 
-struct {
+// The cache's size is set at boot from the amount of free
+// memory (see BCACHEDIV). Buffers are hashed by (dev, blockno)
+// into buckets, each with its own lock, so lookups of
+// different blocks don't contend. A buffer's dev and blockno
+// can only change while its old and new buckets are locked,
+// one after the other, and only when its refcnt is 0.
+//
+// Buffers are recycled with the 2Q policy, so that reading
+// through a big file once doesn't push out the blocks that
+// are used over and over. A block read for the first time
+// goes on A1in, a FIFO. If it's still cached when it is read
+// again, it stays there; once recycled, its number is
+// remembered for a while on A1out (a "ghost" list, with no
+// data), and if it's read again while there, it goes on Am,
+// for blocks in regular use. Am is managed with CLOCK: a hit
+// only sets b->referenced, and the eviction sweep gives
+// referenced buffers a second chance. A1in is held to a
+// quarter of the buffers, as long as Am has some to spare.
+//
+// Only one CPU at a time recycles a buffer, holding
+// bcache.evict, which protects the queues and A1out.
+#define NBUCKET 251
+
+enum { A1IN, AM };
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;
+};
+
+// the number of a recently recycled block, on A1out.
+struct ghost {
+  uint dev;
+  uint blockno;
+  struct ghost *next;      // hash chain
+  struct ghost *fnext;     // A1out, oldest first
+};
+
+struct {
+  struct spinlock evict;
+  struct bucket bucket[NBUCKET];
+  int nbuf;
+
+  // queues, oldest first, through qnext and qprev.
+  struct buf queue[2];     // list heads, for A1IN and AM
+  int nqueue[2];
+  int kin;                 // A1in's share of the buffers
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct ghost *ghost[NBUCKET];  // A1out, hashed
+  struct ghost *oldest, *newest; // A1out, in FIFO order
+  int nghost, kout;              // A1out's length and maximum
+
+  uint64 hits, misses, ghosthits, readaheads;  // changed with atomic instructions
 } bcache;
 
+static int
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+static struct bucket*
+hash(uint dev, uint blockno)
+{
+  return &bcache.bucket[bhash(dev, blockno)];
+}
+
+// Caller must hold bcache.evict.
+static void
+qremove(struct buf *b)
+{
+  b->qprev->qnext = b->qnext;
+  b->qnext->qprev = b->qprev;
+  bcache.nqueue[b->queue]--;
+}
+
+// Add b to the new end of queue q.
+// Caller must hold bcache.evict.
+static void
+qappend(struct buf *b, int q)
+{
+  struct buf *h = &bcache.queue[q];
+
+  b->queue = q;
+  b->qnext = h;
+  b->qprev = h->qprev;
+  h->qprev->qnext = b;
+  h->qprev = b;
+  bcache.nqueue[q]++;
+}
+
+// Remember that block blockno on dev was recently recycled
+// from A1in, forgetting the oldest such block if need be.
+// Caller must hold bcache.evict.
+static void
+ghostadd(uint dev, uint blockno)
+{
+  struct ghost *g, **gp;
+
+  if(bcache.nghost < bcache.kout && (g = kmalloc(sizeof(*g))) != 0){
+    bcache.nghost++;
+  } else if((g = bcache.oldest) != 0){
+    bcache.oldest = g->fnext;
+    if(bcache.oldest == 0)
+      bcache.newest = 0;
+    // it may have been taken off its chain by ghostfind().
+    for(gp = &bcache.ghost[bhash(g->dev, g->blockno)]; *gp && *gp != g; gp = &(*gp)->next)
+      ;
+    if(*gp)
+      *gp = g->next;
+  } else {
+    return;
+  }
+  g->dev = dev;
+  g->blockno = blockno;
+  g->next = bcache.ghost[bhash(dev, blockno)];
+  bcache.ghost[bhash(dev, blockno)] = g;
+  g->fnext = 0;
+  if(bcache.newest)
+    bcache.newest->fnext = g;
+  else
+    bcache.oldest = g;
+  bcache.newest = g;
+}
+
+// Is block blockno on dev on A1out? If so, it's about to be
+// cached again, so take it off its hash chain; it stays on
+// the FIFO until it's the oldest.
+// Caller must hold bcache.evict.
+static int
+ghostfind(uint dev, uint blockno)
+{
+  struct ghost *g, **gp;
+
+  for(gp = &bcache.ghost[bhash(dev, blockno)]; (g = *gp) != 0; gp = &g->next){
+    if(g->dev == dev && g->blockno == blockno){
+      *gp = g->next;
+      return 1;
+    }
+  }
+  return 0;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  uchar *data = 0;
 
-  initlock(&bcache.lock, "bcache");
+  initlock(&bcache.evict, "bcache");
+  for(int i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+  for(int q = A1IN; q <= AM; q++){
+    bcache.queue[q].qnext = &bcache.queue[q];
+    bcache.queue[q].qprev = &bcache.queue[q];
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // all buffers start out free, as the oldest on A1in, with
+  // a number no block has and in no bucket.
+  // a commit holds LOGSIZE log blocks while the
+  // LOGSIZE logged blocks stay pinned, so never fewer
+  // than NBUF, whatever memory is free.
+  bcache.nbuf = kfreemem() / BCACHEDIV / BSIZE;
+  if(bcache.nbuf < NBUF)
+    bcache.nbuf = NBUF;
+  for(int i = 0; i < bcache.nbuf; i++){
+    if(i % (PGSIZE / BSIZE) == 0 && (data = kalloc()) == 0)
+      panic("binit");
+    if((b = kmalloc(sizeof(*b))) == 0)
+      panic("binit");
+    memset(b, 0, sizeof(*b));
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->data = data + (i % (PGSIZE / BSIZE)) * BSIZE;
+    b->dev = ~0;
+    b->blockno = ~0;
+    qappend(b, A1IN);
   }
+  bcache.kin = bcache.nbuf / 4;
+  bcache.kout = bcache.nbuf / 2;
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Find the cached buffer for block blockno on dev, in
+// bucket bk.
+// Caller must hold bk->lock.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+  for(b = bk->head; b; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
       return b;
-    }
+  return 0;
+}
+
+// Look up block blockno on dev and, if it's cached, take a
+// reference to it, unless ahead is set: read-ahead leaves
+// cached blocks alone.
+static struct buf*
+bhit(uint dev, uint blockno, int ahead)
+{
+  struct bucket *bk = hash(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0 && !ahead){
+    b->refcnt++;
+    b->referenced = 1;
+    __sync_fetch_and_add(&bcache.hits, 1);
   }
+  release(&bk->lock);
+  return b;
+}
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
+// Return the oldest unused buffer on queue q, with its
+// bucket locked, or 0. On Am, buffers that have been used
+// since the last look get moved to the new end instead.
+// Caller must hold bcache.evict.
+static struct buf*
+victim(int q)
+{
+  struct buf *b, *next;
+  struct bucket *bk;
+  int n = bcache.nqueue[q];
+
+  // at most two passes over Am: the first may only clear
+  // b->referenced.
+  if(q == AM)
+    n *= 2;
+  for(b = bcache.queue[q].qnext; n > 0 && b != &bcache.queue[q]; b = next, n--){
+    next = b->qnext;
+    bk = hash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if(b->refcnt == 0 && (q == A1IN || !b->referenced))
       return b;
+    if(q == AM && b->refcnt == 0){
+      // second chance.
+      b->referenced = 0;
+      qremove(b);
+      qappend(b, AM);
+      if(next == &bcache.queue[AM])
+        next = bcache.queue[AM].qnext;
     }
+    release(&bk->lock);
   }
-  panic("bget: no buffers");
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// For read-ahead (ahead set), return 0 if the block is
+// already cached, or if every buffer is in use: reading
+// ahead is optional, so it mustn't panic.
+static struct buf*
+bget(uint dev, uint blockno, int ahead)
+{
+  struct bucket *bk = hash(dev, blockno), *old;
+  struct buf *b, **pp;
+  int q;
+
+  if((b = bhit(dev, blockno, ahead)) != 0)
+    goto found;
+
+  // Not cached. Look again holding bcache.evict, in case
+  // another CPU was recycling a buffer for the same block.
+  acquire(&bcache.evict);
+  if((b = bhit(dev, blockno, ahead)) != 0){
+    release(&bcache.evict);
+    goto found;
+  }
+  // Recycle a buffer from A1in if it has more than its share,
+  // and otherwise from Am.
+  b = 0;
+  if(bcache.nqueue[A1IN] > bcache.kin)
+    b = victim(A1IN);
+  if(b == 0)
+    b = victim(AM);
+  if(b == 0)
+    b = victim(A1IN);
+  if(b == 0 && ahead){
+    release(&bcache.evict);
+    return 0;
+  }
+  if(b == 0)
+    panic("bget: no buffers");
+  if(ahead)
+    __sync_fetch_and_add(&bcache.readaheads, 1);
+  else
+    __sync_fetch_and_add(&bcache.misses, 1);
+
+  // take it out of its bucket, if it has ever been used;
+  // its bucket lock is held.
+  old = hash(b->dev, b->blockno);
+  if(b->blockno != ~0){
+    for(pp = &old->head; *pp != b; pp = &(*pp)->next)
+      ;
+    *pp = b->next;
+  }
+  if(b->queue == A1IN && b->valid)
+    ghostadd(b->dev, b->blockno);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->referenced = 0;
+  release(&old->lock);
+
+  q = A1IN;
+  if(ghostfind(dev, blockno)){
+    q = AM;
+    __sync_fetch_and_add(&bcache.ghosthits, 1);
+  }
+  qremove(b);
+  qappend(b, q);
+
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.evict);
+  acquiresleep(&b->lock);
+  return b;
+
+found:
+  if(ahead)
+    return 0;
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,7 +361,7 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
     virtio_disk_rw(b, 0);
     b->valid = 1;
@@ -111,8 +378,37 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk, without waiting.
+// b must be locked; call bwait(b) before using it again.
+// Writes started one after another go to the disk together,
+// when the first of them is waited for.
+void
+bwritestart(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwritestart");
+  virtio_disk_start(b, 1);
+}
+
+// Wait for the write of b started by bwritestart().
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
+// Drop a reference to b.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = hash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +416,93 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
+  bput(b);
+}
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+// Start reading the n blocks blocknos[] on dev into the cache,
+// those that aren't there already, without waiting for the
+// disk. A later bread() of one of them waits for the buffer's
+// lock, which is held until the read finishes (see breaddone).
+void
+breadahead(uint dev, uint *blocknos, int n)
+{
+  struct buf *b;
+
+  for(int i = 0; i < n; i++){
+    if((b = bget(dev, blocknos[i], 1)) == 0){
+      if(bhit(dev, blocknos[i], 1) == 0)
+        break;  // no free buffer; read the rest when needed.
+      continue;
+    }
+    if(virtio_disk_readahead(b) < 0){
+      // the disk is busy; read the rest when they're needed.
+      brelse(b);
+      break;
+    }
   }
-  
-  release(&bcache.lock);
+  virtio_disk_kick();
+}
+
+// Called by the disk driver, with interrupts off, when a
+// read started by breadahead() has finished.
+void
+breaddone(struct buf *b)
+{
+  b->valid = 1;
+  releasesleep(&b->lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
+// Forget the contents of every unused buffer, so that the
+// blocks have to be read from the disk again. Buffers not in
+// use hold no changes that haven't been written, since the
+// log pins the buffers it hasn't installed yet.
+void
+bdrop(void)
+{
+  struct bucket *bk;
+  struct buf *b;
 
+  acquire(&bcache.evict);
+  for(int q = A1IN; q <= AM; q++){
+    for(b = bcache.queue[q].qnext; b != &bcache.queue[q]; b = b->qnext){
+      bk = hash(b->dev, b->blockno);
+      acquire(&bk->lock);
+      if(b->refcnt == 0)
+        b->valid = 0;
+      release(&bk->lock);
+    }
+  }
+  release(&bcache.evict);
+}
+
+// Copy out the buffer cache's hit and miss counts, and the
+// disk driver's request counts.
+void
+bstat(struct bstat *st)
+{
+  st->nbuf = bcache.nbuf;
+  st->hits = __atomic_load_n(&bcache.hits, __ATOMIC_RELAXED);
+  st->misses = __atomic_load_n(&bcache.misses, __ATOMIC_RELAXED);
+  st->ghosthits = __atomic_load_n(&bcache.ghosthits, __ATOMIC_RELAXED);
+  st->readaheads = __atomic_load_n(&bcache.readaheads, __ATOMIC_RELAXED);
+  virtio_disk_stat(&st->diskreqs, &st->diskblocks);
+}
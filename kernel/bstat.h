@@ -0,0 +1,11 @@
+// Buffer cache and disk statistics, as returned by the bstat()
+// system call. The counts are since boot.
+struct bstat {
+  int nbuf;           // number of buffers
+  uint64 hits;        // bget()s that found the block cached
+  uint64 misses;      // bget()s that had to recycle a buffer
+  uint64 ghosthits;   // blocks cached again soon after being recycled
+  uint64 readaheads;  // blocks read ahead of being asked for
+  uint64 diskreqs;    // requests given to the disk
+  uint64 diskblocks;  // blocks those requests read or wrote
+};
@@ -1,12 +1,16 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  struct buf *dnext; // next buf in the same disk request
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  struct buf *next; // hash bucket list
+  struct buf *qnext; // replacement queue (see bio.c)
+  struct buf *qprev;
+  int queue;        // which queue
+  int referenced;   // used since the last eviction sweep?
+  uchar *data;      // BSIZE bytes
 };
 
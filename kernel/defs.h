@@ -2,6 +2,8 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct lockstat;
+struct bstat;
 struct pipe;
 struct proc;
 struct spinlock;
@@ -12,10 +14,16 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint*, int);
+void            bwritestart(struct buf*);
+void            bwait(struct buf*);
+void            breaddone(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            bstat(struct bstat*);
+void            bdrop(void);
 
 // console.c
 void            consoleinit(void);
@@ -52,6 +60,7 @@ struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
+int             setreadahead(int);
 void            itrunc(struct inode*);
 
 // ramdisk.c
@@ -62,7 +71,19 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void            kdup(void *);
+int             krefcnt(void *);
+void*           ksuperalloc(void);
+void*           kzalloc(void);
+int             kzfill(void);
 void            kinit(void);
+uint64          kfreemem(void);
+
+// slab.c
+void            slabinit(void);
+void*           kmalloc(uint64);
+void            kmfree(void*);
+void            kslabreclaim(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -85,8 +106,7 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
-void            proc_mapstacks(pagetable_t);
+int             growproc(int, uint64*);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -102,10 +122,32 @@ void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
+void            preempt(void);
+int             setpriority(int, int);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 struct proc*    findproc(int);
+void            procput(struct proc*);
+int             getppid(void);
+int             clone(uint64, uint64, uint64);
+int             join(int);
+void            tlbshootdown(pagetable_t);
+
+// shm.c
+void            shminit(void);
+int             shmopen(struct proc*, int, uint64);
+void            shmclose(struct proc*);
+void            shmdup(int);
+void            shmput(int);
+uint64          shmattach(struct proc*, int, uint64);
+int             shmdetach(struct proc*, uint64);
+
+// futex.c
+void            futexinit(void);
+int             futex_wait(uint64, uint);
+int             futex_wake(uint64, int);
+void            futex_share(struct proc*, uint64, uint64);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -114,9 +156,11 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            freelock(struct spinlock*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+int             lockstat(int, struct lockstat*, int);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
@@ -147,6 +191,7 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            ipi(int);
 
 // uart.c
 void            uartinit(void);
@@ -165,14 +210,23 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcow(pagetable_t, uint64);
+uint64          vmfault(struct proc*, uint64, int);
 void            uvmfree(pagetable_t, uint64);
-void            uvmunmap(pagetable_t, uint64, uint64, int);
+int             uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
+uint64          walkref(pagetable_t, uint64, int, int*);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
+struct vma*     vmacreate(struct proc*, uint64, uint64, uint64, int);
+struct vma*     vmalookup(struct proc*, uint64);
+int             vmaremove(struct proc*, struct vma*, uint64, uint64);
+void            vmafreeall(struct proc*);
+int             vmacopy(struct proc*, struct proc*);
+uint64          vmalimit(struct proc*);
 // added for task 1
 uint64          map_shared_pages(struct proc*, struct proc*, uint64, uint64);
 uint64          unmap_shared_pages(struct proc*, uint64, uint64);
@@ -186,6 +240,11 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_wait(struct buf *);
+int             virtio_disk_readahead(struct buf *);
+void            virtio_disk_kick(void);
+void            virtio_disk_stat(uint64*, uint64*);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -31,6 +31,10 @@ exec(char *path, char **argv)
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // the other threads would lose their address space.
+  if(p->leader != p || p->nthread > 1)
+    return -1;
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -120,10 +124,18 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
+  // Commit to the user image, unless a thread has been
+  // created meanwhile.
+  acquire(&p->lock);
+  if(p->nthread > 1){
+    release(&p->lock);
+    goto bad;
+  }
+  vmafreeall(p);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  release(&p->lock);
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
@@ -18,8 +18,11 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // in itable's list
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  uint nextbn;        // block after the last one read (see readi)
+  uint raend;         // blocks before this have been read ahead
 
   short type;         // copy of disk inode
   short major;
@@ -119,7 +119,9 @@ bfree(int dev, uint b)
 // to provide a place for synchronizing access
 // to inodes used by multiple processes. The in-memory
 // inodes include book-keeping information that is
-// not stored on disk: ip->ref and ip->valid.
+// not stored on disk: ip->ref and ip->valid. The table
+// is a list of inodes allocated with kmalloc(), so it
+// has no fixed size.
 //
 // An inode and its in-memory representation go through a
 // sequence of states before they can be used by the
@@ -129,18 +131,16 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref,
+//   and frees the entry when ref reaches zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   the disk and sets ip->valid.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,8 +164,8 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
+// The itable.lock spin-lock protects the list of itable
+// entries. Since ip->ref indicates whether an entry is in use,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold itable.lock while using any of those fields.
 //
@@ -175,18 +175,13 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *inode;   // list of in-use inodes
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -246,31 +241,31 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.inode; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  // Add a new entry.
+  if((ip = kmalloc(sizeof(*ip))) == 0)
+    panic("iget: no memory");
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->nextbn = 0;
+  ip->raend = 0;
+  ip->next = itable.inode;
+  itable.inode = ip;
   release(&itable.lock);
 
   return ip;
@@ -327,8 +322,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode table entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -336,6 +331,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode **ipp;
+
   acquire(&itable.lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
@@ -357,8 +354,18 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref > 0){
+    release(&itable.lock);
+    return;
+  }
+
+  // no one else can find ip once it's off the list.
+  for(ipp = &itable.inode; *ipp != ip; ipp = &(*ipp)->next)
+    ;
+  *ipp = ip->next;
   release(&itable.lock);
+  freelock(&ip->lock.lk);
+  kmfree(ip);
 }
 
 // Common idiom: unlock, then put.
@@ -464,6 +471,51 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Number of blocks to read ahead of sequential reads;
+// 0 turns read-ahead off.
+static int nreadahead = NREADAHEAD;
+
+// Set the read-ahead window to n blocks, if n isn't negative.
+// Returns the old window.
+int
+setreadahead(int n)
+{
+  int old = nreadahead;
+
+  if(n > MAXREADAHEAD)
+    n = MAXREADAHEAD;
+  if(n >= 0)
+    nreadahead = n;
+  return old;
+}
+
+// ip is being read sequentially, and block bn is next:
+// start reading the blocks of the window after it that
+// haven't been started already.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint end = bn + 1 + nreadahead;
+  uint nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  uint addrs[MAXREADAHEAD];
+  int n = 0;
+
+  if(end > nblocks)
+    end = nblocks;
+  if(ip->raend < bn + 1)
+    ip->raend = bn + 1;
+  // the blocks are all there, since files have no holes,
+  // so bmap() won't allocate any.
+  for(; ip->raend < end; ip->raend++){
+    if((addrs[n] = bmap(ip, ip->raend)) == 0)
+      break;
+    n++;
+  }
+  if(n > 0)
+    breadahead(ip->dev, addrs, n);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -473,17 +525,29 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
+  int seq;
 
   if(off > ip->size || off + n < off)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
 
+  // a read that starts in the block after the last read, or
+  // in the same block, continues a sequential run.
+  seq = off/BSIZE == ip->nextbn || off/BSIZE + 1 == ip->nextbn;
+  if(!seq)
+    ip->raend = 0;
+
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
+    ip->nextbn = off/BSIZE + 1;
     bp = bread(ip->dev, addr);
+    // start read-ahead only once the demand block is in,
+    // so that its read doesn't queue behind the others.
+    if(seq && nreadahead > 0)
+      readahead(ip, off/BSIZE);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -0,0 +1,187 @@
+//
+// Futexes: sleeping and waking on a word of user memory.
+//
+// futex_wait(addr, expected) sleeps until a futex_wake() on
+// the same word, unless the word no longer holds expected;
+// user code builds mutexes and condition variables from the
+// two (see user/sync.c). A word in a shared page (PTE_S) is
+// identified by its physical address, so processes that
+// share a page with map_shared_pages() or shm_attach() can
+// wait for each other. A word in a private page is identified
+// by its address space (the leader) and virtual address,
+// since copy-on-write can move the page to a new frame
+// whenever the process forks. When map_shared_pages() makes
+// a private page shared, futex_share() wakes the page's
+// waiters, so that they wait again under the new key.
+//
+// Waiters are hashed by key. A bucket's lock is held from
+// checking the word to going to sleep, and by futex_wake(),
+// so a wake that follows a store to the word can't be missed.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+// a process waiting in futex_wait(), on its kernel stack.
+struct futexw {
+  struct proc *mm;   // leader, or 0 if key is a physical address
+  uint64 key;
+  int woken;
+  struct futexw *next;
+};
+
+#define NFUTEXQ 61
+
+struct futexq {
+  struct spinlock lock;
+  struct futexw *head;
+} futexq[NFUTEXQ];
+
+// bumped by futex_share(), so that a futex_wait() that made
+// a private key before futex_share() looked at its bucket
+// can tell, and make the key again.
+static uint futexgen;
+
+void
+futexinit(void)
+{
+  for(int i = 0; i < NFUTEXQ; i++)
+    initlock(&futexq[i].lock, "futex");
+}
+
+static struct futexq*
+futexq_of(struct futexw *w)
+{
+  return &futexq[((w->key >> 2) ^ ((uint64)w->mm >> 4)) % NFUTEXQ];
+}
+
+// Fill in w's key for the current process's word at user
+// address addr. Returns -1 if addr isn't a mapped word.
+static int
+futexkey(uint64 addr, struct futexw *w)
+{
+  struct proc *p = myproc();
+  uint64 pa;
+  int shared;
+
+  if(addr % sizeof(uint) != 0)
+    return -1;
+  if((pa = walkref(p->pagetable, PGROUNDDOWN(addr), 0, &shared)) == 0)
+    return -1;
+  kfree((void*)pa);
+  if(shared){
+    w->mm = 0;
+    w->key = pa + addr % PGSIZE;
+  } else {
+    w->mm = p->leader;
+    w->key = addr;
+  }
+  return 0;
+}
+
+// Sleep until a futex_wake() on addr, if *addr is expected.
+// Returns 0 when woken, or -1 if *addr isn't expected, addr
+// is bad, or the process is killed.
+int
+futex_wait(uint64 addr, uint expected)
+{
+  struct futexw w;
+  struct futexw **wp;
+  struct futexq *q;
+  struct proc *p = myproc();
+  uint val, gen;
+
+ again:
+  gen = __atomic_load_n(&futexgen, __ATOMIC_SEQ_CST);
+  if(futexkey(addr, &w) < 0)
+    return -1;
+  w.woken = 0;
+  q = futexq_of(&w);
+
+  // read the word through the page table, not through the
+  // frame futexkey() saw, which a store may have copied away
+  // from since.
+  acquire(&q->lock);
+  if(w.mm && gen != __atomic_load_n(&futexgen, __ATOMIC_SEQ_CST)){
+    release(&q->lock);
+    goto again;
+  }
+  if(copyin(p->pagetable, (char*)&val, addr, sizeof(val)) < 0 || val != expected){
+    release(&q->lock);
+    return -1;
+  }
+  w.next = q->head;
+  q->head = &w;
+  while(!w.woken){
+    if(killed(p)){
+      for(wp = &q->head; *wp != &w; wp = &(*wp)->next)
+        ;
+      *wp = w.next;
+      release(&q->lock);
+      return -1;
+    }
+    sleep(&w, &q->lock);
+  }
+  release(&q->lock);
+  return 0;
+}
+
+// Wake up to n processes waiting on addr.
+// Returns the number woken, or -1 if addr is bad.
+int
+futex_wake(uint64 addr, int n)
+{
+  struct futexw *w, **wp, k;
+  struct futexq *q;
+  int woken = 0;
+
+  if(futexkey(addr, &k) < 0)
+    return -1;
+  q = futexq_of(&k);
+
+  acquire(&q->lock);
+  for(wp = &q->head; (w = *wp) != 0 && woken < n; ){
+    if(w->mm != k.mm || w->key != k.key){
+      wp = &w->next;
+      continue;
+    }
+    *wp = w->next;
+    w->woken = 1;
+    wakeup(w);
+    woken++;
+  }
+  release(&q->lock);
+  return woken;
+}
+
+// Wake every process waiting on a word of leader's private
+// memory in [start, end), whose pages have just been made
+// shared: from now on a word there is known by its physical
+// address. The waiters see that they were woken, check the
+// word, and wait again if need be. Call with no locks held.
+void
+futex_share(struct proc *leader, uint64 start, uint64 end)
+{
+  struct futexw *w, **wp;
+  struct futexq *q;
+
+  __atomic_fetch_add(&futexgen, 1, __ATOMIC_SEQ_CST);
+  for(q = futexq; q < &futexq[NFUTEXQ]; q++){
+    acquire(&q->lock);
+    for(wp = &q->head; (w = *wp) != 0; ){
+      if(w->mm != leader || w->key < start || w->key >= end){
+        wp = &w->next;
+        continue;
+      }
+      *wp = w->next;
+      w->woken = 1;
+      wakeup(w);
+    }
+    release(&q->lock);
+  }
+}
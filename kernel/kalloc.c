@@ -1,6 +1,9 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages, and
+// 2-megabyte superpages for large user mappings.
+// Pages are reference counted so that user pages can
+// be mapped by more than one process.
 
 #include "types.h"
 #include "param.h"
@@ -18,15 +21,73 @@ struct run {
   struct run *next;
 };
 
-struct {
+// Each CPU has its own list of free pages, with its own
+// lock, so that CPUs allocating and freeing at the same
+// time don't contend. kfree() puts a page on the current
+// CPU's list. A CPU whose list is empty steals a batch of
+// pages from another CPU's list (see ksteal).
+// Each CPU also keeps a few free pages that it zeroed while
+// it had nothing else to do (see kzfill), for kzalloc().
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;               // length of freelist
+  struct run *zerolist;    // free pages that are all zeros
+  int nzero;               // length of zerolist
+} kmem[NCPU];
+
+#define KSTEAL 64  // most pages to steal at once
+#define KZERO  64  // zeroed pages for each CPU to keep
+
+// Filling pages with junk when they are freed and allocated
+// catches dangling references and uninitialized reads, but
+// costs two extra writes of every page; it's only done in
+// debugging builds (make KJUNK=1).
+#ifdef KJUNK
+#define junk(pa, c, n) memset((pa), (c), (n))
+#else
+#define junk(pa, c, n)
+#endif
+
+// Free memory starts out as superpages, wherever an aligned
+// 2-megabyte stretch is free, and 4096-byte pages elsewhere.
+// kalloc() breaks up a superpage only when no CPU has free
+// pages, so superpages last as long as memory isn't tight.
+struct {
+  struct spinlock lock;
+  struct run *superlist;   // free superpages
+} ksuper;
+
+// Reference counts for physical pages, indexed by
+// (pa - KERNBASE) / PGSIZE. A page can be mapped by
+// several page tables (shared mappings); it goes back
+// on the free list only when the last reference is dropped.
+// All the references to pages of a superpage are counted
+// in the entry for its first page, since it's freed whole.
+// The counts are updated with atomic instructions rather
+// than under a lock.
+struct {
+  int count[(PHYSTOP - KERNBASE) / PGSIZE];
+  char super[(PHYSTOP - KERNBASE) / SUPERPGSIZE]; // allocated or free as a superpage?
+} kref;
+
+#define PA2SUPER(pa) (((uint64)(pa) - KERNBASE) / SUPERPGSIZE)
+
+// the reference-count slot for the page at pa.
+static int
+pa2ref(void *pa)
+{
+  if(kref.super[PA2SUPER(pa)])
+    pa = (void*)SUPERPGROUNDDOWN((uint64)pa);
+  return ((uint64)pa - KERNBASE) / PGSIZE;
+}
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(struct kmem *km = kmem; km < &kmem[NCPU]; km++)
+    initlock(&km->lock, "kmem");
+  initlock(&ksuper.lock, "ksuper");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +96,208 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    if((uint64)p % SUPERPGSIZE == 0 && p + SUPERPGSIZE <= (char*)pa_end){
+      kref.super[PA2SUPER(p)] = 1;
+      kref.count[pa2ref(p)] = 1;
+      kfree(p);
+      p += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+    kref.count[pa2ref(p)] = 1;
     kfree(p);
+  }
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
+// Add a reference to the page of physical memory pointed at
+// by pa, which must have been returned by kalloc() or lie in
+// a superpage returned by ksuperalloc().
+// Each kdup() must be balanced by a kfree().
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+
+  if(__sync_fetch_and_add(&kref.count[pa2ref(pa)], 1) < 1)
+    panic("kdup: free page");
+}
+
+// Return the number of references to the page at pa,
+// or to the whole of the superpage it lies in.
+int
+krefcnt(void *pa)
+{
+  return __atomic_load_n(&kref.count[pa2ref(pa)], __ATOMIC_SEQ_CST);
+}
+
+// Drop a reference to the page of physical memory pointed at
+// by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// pa may lie anywhere in a superpage.
+// The page is freed when no references remain.
 void
 kfree(void *pa)
 {
   struct run *r;
+  struct kmem *km;
+  int n, super;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  // a superpage's flag can't change while it has references.
+  super = kref.super[PA2SUPER(pa)];
+  if(super)
+    pa = (void*)SUPERPGROUNDDOWN((uint64)pa);
+
+  n = __sync_sub_and_fetch(&kref.count[pa2ref(pa)], 1);
+  if(n < 0)
+    panic("kfree: free page");
+  if(n > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  junk(pa, 1, super ? SUPERPGSIZE : PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  if(super){
+    acquire(&ksuper.lock);
+    r->next = ksuper.superlist;
+    ksuper.superlist = r;
+    release(&ksuper.lock);
+    return;
+  }
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  release(&km->lock);
+  pop_off();
+}
+
+// Take a page off km's lists, preferring a zeroed one if
+// zero is set and an unzeroed one otherwise. Sets *zeroed
+// if the page is all zeros. Caller must hold km->lock.
+static struct run *
+kpop(struct kmem *km, int zero, int *zeroed)
+{
+  struct run *r;
+
+  if(km->nzero > 0 && (zero || km->nfree == 0)){
+    r = km->zerolist;
+    km->zerolist = r->next;
+    km->nzero--;
+    *zeroed = 1;
+  } else if((r = km->freelist) != 0){
+    km->freelist = r->next;
+    km->nfree--;
+    *zeroed = 0;
+  }
+  return r;
+}
+
+// Find a page for a CPU whose lists km are empty: steal
+// up to half the pages of the first other CPU that has any,
+// or else break up a free superpage. Return one page and
+// put the rest on km. Doesn't hold km->lock while taking
+// another CPU's lock, so two CPUs stealing from each other
+// can't deadlock.
+static struct run *
+ksteal(struct kmem *km)
+{
+  struct run *r = 0, *last, **list;
+  struct kmem *o;
+  int i, n = 0, *count;
+
+  for(i = 1; i < NCPU && r == 0; i++){
+    o = &kmem[(km - kmem + i) % NCPU];
+    acquire(&o->lock);
+    // zeroed pages only as a last resort, since they
+    // lose their zeroing by moving.
+    list = o->nfree > 0 ? &o->freelist : &o->zerolist;
+    count = o->nfree > 0 ? &o->nfree : &o->nzero;
+    if(*count > 0){
+      n = (*count + 1) / 2;
+      if(n > KSTEAL)
+        n = KSTEAL;
+      r = last = *list;
+      for(int j = 1; j < n; j++)
+        last = last->next;
+      *list = last->next;
+      *count -= n;
+      last->next = 0;
+    }
+    release(&o->lock);
+  }
+
+  if(r == 0){
+    acquire(&ksuper.lock);
+    r = ksuper.superlist;
+    if(r){
+      ksuper.superlist = r->next;
+      kref.super[PA2SUPER(r)] = 0;
+    }
+    release(&ksuper.lock);
+    if(r == 0)
+      return 0;
+    n = SUPERPGSIZE / PGSIZE;
+    for(i = 0; i < n - 1; i++)
+      ((struct run*)((char*)r + i*PGSIZE))->next = (struct run*)((char*)r + (i+1)*PGSIZE);
+    last = (struct run*)((char*)r + (n-1)*PGSIZE);
+    last->next = 0;
+  }
+
+  if(n > 1){
+    acquire(&km->lock);
+    last->next = km->freelist;
+    km->freelist = r->next;
+    km->nfree += n - 1;
+    release(&km->lock);
+  }
+  return r;
+}
+
+// Allocate a page, zeroed if zero is set.
+static void *
+kget(int zero)
+{
+  struct run *r;
+  struct kmem *km;
+  int zeroed = 0;
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r = kpop(km, zero, &zeroed);
+  release(&km->lock);
+  if(r == 0)
+    r = ksteal(km);
+  if(r == 0){
+    // out of memory; get back the pages that the slab
+    // allocator is holding on to for free objects.
+    kslabreclaim();
+    acquire(&km->lock);
+    r = kpop(km, zero, &zeroed);
+    release(&km->lock);
+  }
+  pop_off();
+
+  if(r){
+    kref.count[pa2ref(r)] = 1;
+    if(zero && !zeroed)
+      memset((char*)r, 0, PGSIZE);
+    else if(zero)
+      r->next = 0; // the rest of a zeroed page is still zeros.
+    else
+      junk((char*)r, 5, PGSIZE);
+  }
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -67,16 +305,92 @@ kfree(void *pa)
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
+{
+  return kget(0);
+}
+
+// Allocate one 4096-byte page of physical memory, filled
+// with zeros. Usually the page was zeroed ahead of time.
+// Returns 0 if the memory cannot be allocated.
+void *
+kzalloc(void)
+{
+  return kget(1);
+}
+
+// Zero one of this CPU's free pages for kzalloc(), unless
+// it has KZERO zeroed pages already. The scheduler calls
+// this when the CPU has nothing to run, so allocations
+// don't have to pay for the zeroing.
+// Returns 1 if it zeroed a page, 0 if there was nothing to do.
+int
+kzfill(void)
+{
+  struct run *r = 0;
+  struct kmem *km;
+
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  if(km->nzero < KZERO && (r = km->freelist) != 0){
+    km->freelist = r->next;
+    km->nfree--;
+  }
+  release(&km->lock);
+
+  if(r){
+    // the page is off the lists, so no one else can see it.
+    memset(r, 0, PGSIZE);
+    acquire(&km->lock);
+    r->next = km->zerolist;
+    km->zerolist = r;
+    km->nzero++;
+    release(&km->lock);
+  }
+  pop_off();
+  return r != 0;
+}
+
+// Return the number of bytes of free memory, for sizing
+// caches at boot. The count may be stale by the time the
+// caller looks at it.
+uint64
+kfreemem(void)
 {
   struct run *r;
+  uint64 n = 0;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  for(struct kmem *km = kmem; km < &kmem[NCPU]; km++){
+    acquire(&km->lock);
+    n += km->nfree + km->nzero;
+    release(&km->lock);
+  }
+  acquire(&ksuper.lock);
+  for(r = ksuper.superlist; r; r = r->next)
+    n += SUPERPGSIZE / PGSIZE;
+  release(&ksuper.lock);
+  return n * PGSIZE;
+}
 
+// Allocate one 2-megabyte superpage of physically contiguous,
+// aligned memory. Its pages can be shared and freed one at a
+// time with kdup() and kfree(), but the memory is only reused
+// when all of them have been freed.
+// Returns 0 if no superpage is free.
+void *
+ksuperalloc(void)
+{
+  struct run *r;
+
+  acquire(&ksuper.lock);
+  r = ksuper.superlist;
   if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+    ksuper.superlist = r->next;
+  release(&ksuper.lock);
+
+  if(r){
+    kref.count[pa2ref(r)] = 1;
+    junk((char*)r, 5, SUPERPGSIZE);
+  }
   return (void*)r;
 }
@@ -0,0 +1,8 @@
+// Contention counts for all the spinlocks with one name,
+// as returned by the lockstat() system call.
+struct lockstat {
+  char name[16];
+  int nlock;          // number of locks with this name
+  uint64 nacquire;    // total acquire()s
+  uint64 nspin;       // total retries while the lock was held
+};
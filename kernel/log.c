@@ -28,7 +28,9 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are synchronous: write_log() and install_trans()
+// hand all of a transaction's blocks to the disk at once, but
+// wait for them all before going on.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -69,16 +71,21 @@ static void
 install_trans(int recovering)
 {
   int tail;
+  struct buf *dbuf[LOGSIZE];
 
+  // start all the writes, so the disk has them all at once.
   for (tail = 0; tail < log.lh.n; tail++) {
     struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
+    dbuf[tail] = bread(log.dev, log.lh.block[tail]); // read dst
+    memmove(dbuf[tail]->data, lbuf->data, BSIZE);  // copy block to dst
+    bwritestart(dbuf[tail]);  // write dst to disk
     brelse(lbuf);
-    brelse(dbuf);
+  }
+  for (tail = 0; tail < log.lh.n; tail++) {
+    bwait(dbuf[tail]);
+    if(recovering == 0)
+      bunpin(dbuf[tail]);
+    brelse(dbuf[tail]);
   }
 }
 
@@ -179,14 +186,18 @@ static void
 write_log(void)
 {
   int tail;
+  struct buf *to[LOGSIZE];
 
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
+    to[tail] = bread(log.dev, log.start+tail+1); // log block
     struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
+    memmove(to[tail]->data, from->data, BSIZE);
+    bwritestart(to[tail]);  // write the log
     brelse(from);
-    brelse(to);
+  }
+  for (tail = 0; tail < log.lh.n; tail++) {
+    bwait(to[tail]);
+    brelse(to[tail]);
   }
 }
 
@@ -17,6 +17,7 @@ main()
     printf("xv6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small-object allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -27,6 +28,8 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    shminit();       // shared-memory segments
+    futexinit();     // futex wait queues
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -27,6 +27,7 @@
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -62,6 +63,11 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   ...
+//   mmap area (shared mappings, growing down from MMAPTOP)
+//   trapframes of the process's other threads
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define THREADFRAME(i) (TRAPFRAME - (i)*PGSIZE)  // thread i's trapframe; thread 0's is TRAPFRAME
+#define MMAPTOP THREADFRAME(NTHREAD-1)
@@ -1,13 +1,22 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       512  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         (LOGSIZE*2+MAXOPBLOCKS)  // least size of disk block cache
+#define BCACHEDIV    64    // disk block cache gets 1/BCACHEDIV of free memory
+#define NREADAHEAD   8     // default blocks to read ahead of sequential reads
+#define MAXREADAHEAD 64    // most blocks to read ahead
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NSHM         16  // maximum number of shared-memory segments
+#define SHMMAXPAGES 256  // maximum pages in a shared-memory segment
+#define NVMA         16  // mmap-area regions per process
+#define NTHREAD      16  // threads per process, counting the first
+#define NLOCKCLASS   64  // lock names whose contention lockstat reports
+#define SCHEDSLICE    1  // timer ticks a nice-0 process runs before preemption
+#define NICEMIN     -20  // lowest nice value, for the most CPU
+#define NICEMAX      19  // highest nice value, for the least CPU
@@ -8,15 +8,27 @@
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
-
 struct proc *initproc;
 
+// Processes are allocated as they're created, with kmalloc(),
+// and freed when their parent has waited for them and
+// nothing else refers to them (see procput). Each has a
+// slot, which says where its kernel stack is mapped; the
+// free slots are kept on a stack for allocproc().
+struct {
+  struct spinlock lock;
+  int free[NPROC];
+  int nfree;
+} procslot;
+
+extern pagetable_t kernel_pagetable;
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p, int cpu);
 
 extern char trampoline[]; // trampoline.S
 
@@ -26,36 +38,116 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl)
+// Each CPU has a queue of RUNNABLE processes waiting to run
+// on it. A CPU whose queue is empty steals from another's,
+// and if there's nothing to steal, waits for an interrupt.
+// A process is on a queue exactly when it is RUNNABLE and
+// no scheduler has picked it yet. A queue's lock is
+// acquired after any p->lock.
+//
+// Each queue is a weighted fair-share scheduler: a process's
+// vruntime is its run time divided by its weight (see
+// nice2weight), and the queue is kept sorted by vruntime, so
+// the process that is furthest behind its share runs next.
+// A process with a bigger weight also runs for longer before
+// it is preempted (see preempt). While a process is on a
+// queue, the queue's lock protects its vruntime.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;
+  int n;
+  uint64 minvrt;  // vruntime of the last process picked
+} runq[NCPU];
+
+// the weight of each nice value, from NICEMIN to NICEMAX.
+// each step is about 1.25 times the next, so one nice level
+// is worth about 10% of the CPU between two processes.
+static const int nice2weight[] = {
+  88761, 71755, 56483, 46273, 36291,
+  29154, 23254, 18705, 14949, 11916,
+  9548, 7620, 6100, 4904, 3906,
+  3121, 2501, 1991, 1586, 1277,
+  1024, 820, 655, 526, 423,
+  335, 272, 215, 172, 137,
+  110, 87, 70, 56, 45,
+  36, 29, 23, 18, 15,
+};
+#define NICE0 1024  // weight of nice 0
+
+// Sleeping processes, hashed by the channel they sleep on,
+// so that wakeup() looks only at processes that might be
+// sleeping on its channel. A process is on its channel's
+// list from when it goes to sleep until it has woken and
+// run again; its p->chan can only change while the list's
+// lock is held. A list's lock is acquired before any p->lock.
+#define NWAITQ 61
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+static struct waitq*
+chan2waitq(void *chan)
 {
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+  return &waitq[((uint64)chan >> 3) % NWAITQ];
+}
+
+// Live processes, hashed by pid, for findproc(). A process
+// is in the table from when fork() has finished creating it
+// until freeproc(). A bucket's lock is acquired after any
+// p->lock.
+#define NPIDHASH 64
+
+struct pidhash {
+  struct spinlock lock;
+  struct proc *head;
+} pidhash[NPIDHASH];
+
+// Allocate a page for p's kernel stack, and map it high in
+// the kernel's page table, at a place determined by p's slot
+// and followed by an invalid guard page.
+// Returns 0, or -1 if out of memory.
+static int
+proc_mapstack(struct proc *p)
+{
+  char *pa;
+  int err;
+
+  if((pa = kalloc()) == 0)
+    return -1;
+  p->kstack = KSTACK(p->slot);
+  // procslot.lock keeps two CPUs from adding the same
+  // page-table page.
+  acquire(&procslot.lock);
+  err = mappages(kernel_pagetable, p->kstack, PGSIZE, (uint64)pa, PTE_R | PTE_W);
+  release(&procslot.lock);
+  if(err != 0){
+    kfree(pa);
+    return -1;
   }
+  // a CPU's TLB may still hold a translation for the slot's
+  // last kernel stack; the scheduler flushes it before
+  // running p there.
+  p->tlbstale = ~0L;
+  return 0;
 }
 
 // initialize the proc table.
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->state = UNUSED;
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+  for(int i = 0; i < NPIDHASH; i++)
+    initlock(&pidhash[i].lock, "pidhash");
+  initlock(&procslot.lock, "procslot");
+  for(int i = NPROC - 1; i >= 0; i--)
+    procslot.free[procslot.nfree++] = i;
 }
 
 // Must be called with interrupts disabled,
@@ -89,6 +181,32 @@ myproc(void)
   return p;
 }
 
+// Make sure no other CPU's TLB still holds translations
+// from user page table pt, before the caller frees a page
+// that was mapped there. Threads of one process run on
+// several CPUs with the same page table; a CPU running one
+// in user space is interrupted, and its trap into the kernel
+// leaves pt (see usertrap), which is all it takes, since
+// userret flushes the TLB on the way back.
+void
+tlbshootdown(pagetable_t pt)
+{
+  struct cpu *c;
+  uint64 n;
+
+  push_off();
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    // any trap after the caller changed pt will do.
+    n = __atomic_load_n(&c->ntrap, __ATOMIC_SEQ_CST);
+    if(c == mycpu() || __atomic_load_n(&c->upt, __ATOMIC_SEQ_CST) != pt)
+      continue;
+    ipi(c - cpus);
+    while(__atomic_load_n(&c->ntrap, __ATOMIC_SEQ_CST) == n)
+      ;
+  }
+  pop_off();
+}
+
 int
 allocpid()
 {
@@ -102,26 +220,139 @@ allocpid()
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
-static struct proc*
-allocproc(void)
+// Add p to the pid hash. Caller must hold p->lock.
+static void
+pidinsert(struct proc *p)
 {
-  struct proc *p;
+  struct pidhash *h = &pidhash[p->pid % NPIDHASH];
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == UNUSED) {
-      goto found;
-    } else {
-      release(&p->lock);
+  acquire(&h->lock);
+  p->pidnext = h->head;
+  h->head = p;
+  release(&h->lock);
+}
+
+// Take p out of the pid hash, if it's there.
+// Caller must hold p->lock.
+static void
+piddelete(struct proc *p)
+{
+  struct pidhash *h = &pidhash[p->pid % NPIDHASH];
+  struct proc **pp;
+
+  acquire(&h->lock);
+  for(pp = &h->head; *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
     }
   }
+  release(&h->lock);
+}
+
+// Drop a reference to p, freeing it and its kernel stack
+// when none remain. The process's parent holds a reference
+// until wait() has called freeproc(), and findproc() hands
+// out references. Caller must not hold p->lock.
+void
+procput(struct proc *p)
+{
+  if(__sync_sub_and_fetch(&p->ref, 1) > 0)
+    return;
+  if(p->state != UNUSED)
+    panic("procput");
+  acquire(&procslot.lock);
+  uvmunmap(kernel_pagetable, p->kstack, 1, 1);
+  procslot.free[procslot.nfree++] = p->slot;
+  release(&procslot.lock);
+  freelock(&p->lock);
+  kmfree(p);
+}
+
+// Map p's trapframe into lp's address space, in a free
+// THREADFRAME slot, making p a thread of lp.
+// Returns 0, or -1 if lp has NTHREAD threads or out of memory.
+static int
+threadattach(struct proc *p, struct proc *lp)
+{
+  int i;
+
+  acquire(&lp->lock);
+  for(i = 1; i < NTHREAD && (lp->threadmask & (1 << i)); i++)
+    ;
+  if(i == NTHREAD || mappages(lp->pagetable, THREADFRAME(i), PGSIZE,
+                              (uint64)p->trapframe, PTE_R | PTE_W) != 0){
+    release(&lp->lock);
+    return -1;
+  }
+  lp->threadmask |= 1 << i;
+  lp->nthread++;
+  p->pagetable = lp->pagetable;
+  release(&lp->lock);
+
+  p->leader = lp;
+  p->tslot = i;
+  p->tfva = THREADFRAME(i);
   return 0;
+}
+
+// Undo threadattach(), freeing p's trapframe.
+// Caller must hold p->lock.
+static void
+threaddetach(struct proc *p)
+{
+  struct proc *lp = p->leader;
+
+  acquire(&lp->lock);
+  // other CPUs running lp's threads may have the trapframe
+  // in their TLBs; uvmunmap() shoots it down before freeing.
+  uvmunmap(lp->pagetable, p->tfva, 1, 1);
+  lp->threadmask &= ~(1 << p->tslot);
+  lp->nthread--;
+  release(&lp->lock);
+}
+
+// Allocate a proc, in a free slot, and initialize the state
+// required to run in the kernel. If lp is not 0, the proc is
+// a new thread of lp, sharing its address space; otherwise it
+// gets an empty one of its own. Return it with p->lock held.
+// If there are no free slots, or a memory allocation fails,
+// return 0.
+static struct proc*
+allocproc(struct proc *lp)
+{
+  struct proc *p;
+  int slot;
+
+  acquire(&procslot.lock);
+  if(procslot.nfree == 0){
+    release(&procslot.lock);
+    return 0;
+  }
+  slot = procslot.free[--procslot.nfree];
+  release(&procslot.lock);
 
-found:
+  if((p = kmalloc(sizeof(*p))) == 0){
+    acquire(&procslot.lock);
+    procslot.free[procslot.nfree++] = slot;
+    release(&procslot.lock);
+    return 0;
+  }
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  p->slot = slot;
+  p->ref = 1;
+  p->state = UNUSED;
+  if(proc_mapstack(p) < 0){
+    acquire(&procslot.lock);
+    procslot.free[procslot.nfree++] = slot;
+    release(&procslot.lock);
+    freelock(&p->lock);
+    kmfree(p);
+    return 0;
+  }
+
+  acquire(&p->lock);
   p->pid = allocpid();
   p->state = USED;
 
@@ -129,15 +360,31 @@ found:
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
     freeproc(p);
     release(&p->lock);
+    procput(p);
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
-    freeproc(p);
-    release(&p->lock);
-    return 0;
+  if(lp){
+    if(threadattach(p, lp) < 0){
+      freeproc(p);
+      release(&p->lock);
+      procput(p);
+      return 0;
+    }
+  } else {
+    p->leader = p;
+    p->tfva = TRAPFRAME;
+    p->nthread = 1;
+    p->threadmask = 1;
+
+    // An empty user page table.
+    p->pagetable = proc_pagetable(p);
+    if(p->pagetable == 0){
+      freeproc(p);
+      release(&p->lock);
+      procput(p);
+      return 0;
+    }
   }
 
   // Set up new context to start executing at forkret,
@@ -149,25 +396,41 @@ found:
   return p;
 }
 
-// free a proc structure and the data hanging from it,
-// including user pages.
+// free the data hanging from a proc structure,
+// including user pages. Pages shared with other processes
+// stay allocated until their last mapping goes away; a
+// thread's address space belongs to its leader.
+// The structure itself is freed by procput().
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
 {
-  if(p->trapframe)
-    kfree((void*)p->trapframe);
+  if(p->leader && p->leader != p){
+    threaddetach(p);
+  } else {
+    if(p->trapframe)
+      kfree((void*)p->trapframe);
+    if(p->pagetable){
+      vmafreeall(p);
+      proc_freepagetable(p->pagetable, p->sz);
+    }
+  }
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  if(p->pid)
+    piddelete(p);
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->nice = 0;
+  p->vruntime = 0;
+  p->leader = 0;
+  p->nthread = 0;
+  p->threadmask = 0;
   p->state = UNUSED;
 }
 
@@ -234,7 +497,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy initcode's instructions
@@ -249,28 +512,42 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  pidinsert(p);
+  setrunnable(p, cpuid());
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; vmfault() allocates
+// the pages when they are first touched.
+// Sets *oldsz to the size before the change, read under
+// the same lock, so that racing threads each get their own.
 // Return 0 on success, -1 on failure.
 int
-growproc(int n)
+growproc(int n, uint64 *oldsz)
 {
   uint64 sz;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
 
-  sz = p->sz;
+  // the heap mustn't grow into the mmap area.
+  acquire(&p->lock);
+  sz = *oldsz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > vmalimit(p)){
+      release(&p->lock);
       return -1;
     }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if(uvmdealloc(p->pagetable, sz, sz + n) != sz + n){
+      release(&p->lock);
+      return -1;
+    }
+    sz += n;
   }
   p->sz = sz;
+  release(&p->lock);
   return 0;
 }
 
@@ -282,19 +559,36 @@ fork(void)
   int i, pid;
   struct proc *np;
   struct proc *p = myproc();
+  struct proc *lp = p->leader;
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child, and share the
+  // parent's mmap area. lp->lock keeps the parent's other
+  // threads from changing the address space meanwhile.
+  // nobody can be holding np->lock and waiting for lp->lock,
+  // since np isn't in the pid hash yet, so findproc() can't
+  // return it.
+  acquire(&lp->lock);
+  if(uvmcopy(lp->pagetable, np->pagetable, lp->sz) < 0){
+    release(&lp->lock);
+    freeproc(np);
+    release(&np->lock);
+    procput(np);
+    return -1;
+  }
+  np->sz = lp->sz;
+  if(vmacopy(lp, np) < 0){
+    release(&lp->lock);
     freeproc(np);
     release(&np->lock);
+    procput(np);
     return -1;
   }
-  np->sz = p->sz;
+  release(&lp->lock);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -310,21 +604,160 @@ fork(void)
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
+  // the child starts level with the parent; setrunnable()
+  // moves it up to the run queue's minimum if need be.
+  np->nice = p->nice;
+  np->vruntime = p->vruntime;
+
   pid = np->pid;
 
   release(&np->lock);
 
   acquire(&wait_lock);
   np->parent = p;
+  np->sibling = p->children;
+  p->children = np;
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  pidinsert(np);
+  setrunnable(np, cpuid());
   release(&np->lock);
 
   return pid;
 }
 
+// Create a new thread of the current process, sharing its
+// address space, that starts by calling fn(arg) on the
+// given stack. It gets its own copies of the open file
+// descriptors, like a forked child. Returns its tid, which
+// is a pid, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int i, tid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *lp = p->leader;
+
+  if((np = allocproc(lp)) == 0)
+    return -1;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+
+  for(i = 0; i < NOFILE; i++)
+    if(p->ofile[i])
+      np->ofile[i] = filedup(p->ofile[i]);
+  np->cwd = idup(p->cwd);
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  np->nice = p->nice;
+  np->vruntime = p->vruntime;
+
+  tid = np->pid;
+
+  release(&np->lock);
+
+  // a thread is a child of its leader, whatever thread
+  // created it, so that join() and exit() can find it.
+  acquire(&wait_lock);
+  np->parent = lp;
+  np->sibling = lp->children;
+  lp->children = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  pidinsert(np);
+  setrunnable(np, cpuid());
+  release(&np->lock);
+
+  return tid;
+}
+
+// Free thread pp, a zombie, after unlinking it from its
+// leader's children at *ppp. Caller must hold wait_lock.
+static void
+reapthread(struct proc *pp, struct proc **ppp)
+{
+  acquire(&pp->lock);
+  *ppp = pp->sibling;
+  freeproc(pp);
+  release(&pp->lock);
+  procput(pp);
+}
+
+// Wait for thread tid of the current process to exit.
+// Returns 0, or -1 if there is no such thread.
+int
+join(int tid)
+{
+  struct proc *pp, **ppp;
+  struct proc *p = myproc();
+  struct proc *lp = p->leader;
+  int state;
+
+  acquire(&wait_lock);
+  for(;;){
+    for(ppp = &lp->children; (pp = *ppp) != 0; ppp = &pp->sibling)
+      if(pp->pid == tid && pp->leader == lp && pp != p)
+        break;
+    if(pp == 0 || killed(p)){
+      release(&wait_lock);
+      return -1;
+    }
+    acquire(&pp->lock);
+    state = pp->state;
+    release(&pp->lock);
+    if(state == ZOMBIE){
+      reapthread(pp, ppp);
+      release(&wait_lock);
+      return 0;
+    }
+    // exit() wakes up the leader.
+    sleep(lp, &wait_lock);
+  }
+}
+
+// Kill leader p's other threads and free them once they
+// have exited, so that p has the address space to itself.
+static void
+reapthreads(struct proc *p)
+{
+  struct proc *pp, **ppp;
+  int n;
+
+  acquire(&wait_lock);
+  for(;;){
+    n = 0;
+    for(ppp = &p->children; (pp = *ppp) != 0; ){
+      if(pp->leader != p){
+        ppp = &pp->sibling;
+        continue;
+      }
+      acquire(&pp->lock);
+      if(pp->state == ZOMBIE){
+        release(&pp->lock);
+        reapthread(pp, ppp);
+        continue;
+      }
+      pp->killed = 1;
+      if(pp->state == SLEEPING)
+        setrunnable(pp, pp->cpu);
+      release(&pp->lock);
+      n++;
+      ppp = &pp->sibling;
+    }
+    if(n == 0)
+      break;
+    sleep(p, &wait_lock);
+  }
+  release(&wait_lock);
+}
+
 // Pass p's abandoned children to init.
 // Caller must hold wait_lock.
 void
@@ -332,12 +765,17 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    if(pp->parent == p){
-      pp->parent = initproc;
-      wakeup(initproc);
-    }
+  if(p->children == 0)
+    return;
+  for(pp = p->children; ; pp = pp->sibling){
+    pp->parent = initproc;
+    if(pp->sibling == 0)
+      break;
   }
+  pp->sibling = initproc->children;
+  initproc->children = p->children;
+  p->children = 0;
+  wakeup(initproc);
 }
 
 // Exit the current process.  Does not return.
@@ -351,6 +789,10 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // the address space goes away with the leader.
+  if(p == p->leader)
+    reapthreads(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -365,6 +807,13 @@ exit(int status)
   end_op();
   p->cwd = 0;
 
+  if(p == p->leader){
+    shmclose(p);
+    acquire(&p->lock);
+    vmafreeall(p);
+    release(&p->lock);
+  }
+
   acquire(&wait_lock);
 
   // Give any children to init.
@@ -386,41 +835,49 @@ exit(int status)
 }
 
 // Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
+// Return -1 if this process has no children. Threads
+// are not children for wait(); see join().
 int
 wait(uint64 addr)
 {
-  struct proc *pp;
-  int havekids, pid;
+  struct proc *pp, **ppp;
+  int pid, xstate, havekids;
   struct proc *p = myproc();
 
   acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Scan through the children looking for exited ones.
     havekids = 0;
-    for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
-        // make sure the child isn't still in exit() or swtch().
-        acquire(&pp->lock);
-
-        havekids = 1;
-        if(pp->state == ZOMBIE){
-          // Found one.
-          pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
-          freeproc(pp);
-          release(&pp->lock);
+    for(ppp = &p->children; (pp = *ppp) != 0; ppp = &pp->sibling){
+      if(pp->leader != pp)
+        continue;
+      havekids = 1;
+
+      // make sure the child isn't still in exit() or swtch().
+      acquire(&pp->lock);
+
+      if(pp->state == ZOMBIE){
+        // Found one.
+        pid = pp->pid;
+        xstate = pp->xstate;
+        release(&pp->lock);
+        // copyout() may fault, taking p's leader's lock,
+        // so don't hold pp->lock; wait_lock keeps pp a zombie.
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                sizeof(xstate)) < 0) {
           release(&wait_lock);
-          return pid;
+          return -1;
         }
+        acquire(&pp->lock);
+        *ppp = pp->sibling;
+        freeproc(pp);
         release(&pp->lock);
+        release(&wait_lock);
+        procput(pp);
+        return pid;
       }
+      release(&pp->lock);
     }
 
     // No point waiting if we don't have any children.
@@ -434,6 +891,114 @@ wait(uint64 addr)
   }
 }
 
+// Charge p for the CPU time it has used since it was last
+// picked or charged. Caller must hold p->lock.
+static void
+account(struct proc *p)
+{
+  uint64 now = r_time();
+
+  p->vruntime += (now - p->runstart) * NICE0 / nice2weight[p->nice - NICEMIN];
+  p->runstart = now;
+}
+
+// Make p RUNNABLE and put it on CPU cpu's run queue, in
+// vruntime order, then wake up an idle CPU, if there is one,
+// to run it or steal it. Caller must hold p->lock.
+static void
+setrunnable(struct proc *p, int cpu)
+{
+  struct runq *rq = &runq[cpu];
+  struct proc **pp;
+
+  p->state = RUNNABLE;
+  p->cpu = cpu;
+  acquire(&rq->lock);
+  // a process that has been asleep, or is new, doesn't get
+  // to make up for the time it wasn't runnable; it starts
+  // level with the queue's minimum.
+  if(p->vruntime < rq->minvrt)
+    p->vruntime = rq->minvrt;
+  for(pp = &rq->head; *pp && (*pp)->vruntime <= p->vruntime; pp = &(*pp)->rqnext)
+    ;
+  p->rqnext = *pp;
+  *pp = p;
+  rq->n++;
+  release(&rq->lock);
+
+  // pairs with the barrier in scheduler() between setting
+  // c->idle and looking at the queues.
+  __sync_synchronize();
+  if(cpus[cpu].idle){
+    ipi(cpu);
+    return;
+  }
+  for(int i = 0; i < NCPU; i++){
+    if(cpus[i].idle){
+      ipi(i);
+      return;
+    }
+  }
+}
+
+// Take the process with the least vruntime off CPU cpu's
+// run queue, or return 0 if it's empty. If steal is set,
+// the process will run on some other CPU, so leave its
+// vruntime relative to this queue's minimum.
+static struct proc*
+rqpop(int cpu, int steal)
+{
+  struct runq *rq = &runq[cpu];
+  struct proc *p;
+
+  // don't take another CPU's lock just to find its queue empty.
+  if(__atomic_load_n(&rq->n, __ATOMIC_RELAXED) == 0)
+    return 0;
+  acquire(&rq->lock);
+  if((p = rq->head) != 0){
+    rq->head = p->rqnext;
+    rq->n--;
+    // setrunnable() keeps queued vruntimes >= minvrt.
+    if(steal)
+      p->vruntime -= rq->minvrt;
+    else
+      rq->minvrt = p->vruntime;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Pick a process for CPU id to run: the next one on its
+// own run queue, or else one stolen from another CPU's.
+static struct proc*
+pickproc(int id)
+{
+  struct proc *p;
+
+  if((p = rqpop(id, 0)) != 0)
+    return p;
+  for(int i = 1; i < NCPU; i++){
+    if((p = rqpop((id + i) % NCPU, 1)) != 0){
+      // keep its lead over the other queue on ours. only
+      // this CPU changes runq[id].minvrt.
+      p->vruntime += runq[id].minvrt;
+      return p;
+    }
+  }
+  return 0;
+}
+
+// Is any process waiting on a run queue?
+static int
+anyrunnable(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    if(__atomic_load_n(&runq[i].n, __ATOMIC_RELAXED) > 0)
+      return 1;
+  }
+  return 0;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -446,27 +1011,56 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
+    if((p = pickproc(id)) != 0){
+      // if p just yielded on another CPU, this waits until
+      // that CPU has switched away from it.
       acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
+      if(p->state != RUNNABLE)
+        panic("scheduler: not runnable");
+
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->cpu = id;
+      if(p->tlbstale & (1L << id)){
+        sfence_vma_va(p->kstack);
+        p->tlbstale &= ~(1L << id);
       }
+      p->slice = SCHEDSLICE * nice2weight[p->nice - NICEMIN] / NICE0;
+      if(p->slice < 1)
+        p->slice = 1;
+      p->runstart = r_time();
+      c->proc = p;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      // yield() has already charged p, which may be queued now.
+      if(p->state != RUNNABLE)
+        account(p);
+      c->proc = 0;
       release(&p->lock);
+    } else if(kzfill() == 0){
+      // nothing to run, and no free page to zero for
+      // kzalloc(): wait for an interrupt. setrunnable() sends
+      // an ipi() to an idle CPU, so look at the queues again
+      // after setting c->idle, and with interrupts off, so an
+      // ipi() can't be taken and forgotten before the wfi.
+      // wfi returns as soon as an interrupt is pending.
+      intr_off();
+      c->idle = 1;
+      __sync_synchronize();
+      if(!anyrunnable())
+        asm volatile("wfi");
+      c->idle = 0;
     }
   }
 }
@@ -504,11 +1098,26 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  account(p);
+  setrunnable(p, p->cpu);
   sched();
   release(&p->lock);
 }
 
+// Called on each timer interrupt while a process is running.
+// Give up the CPU if the process has used up its time slice,
+// which is SCHEDSLICE ticks scaled by its weight, and
+// something else is waiting to run.
+void
+preempt(void)
+{
+  struct proc *p = myproc();
+
+  if(--p->slice > 0 || !anyrunnable())
+    return;
+  yield();
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -536,6 +1145,7 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = chan2waitq(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
@@ -544,20 +1154,35 @@ sleep(void *chan, struct spinlock *lk)
   // (wakeup locks p->lock),
   // so it's okay to release lk.
 
+  acquire(&wq->lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
+  p->wqprev = 0;
+  p->wqnext = wq->head;
+  if(wq->head)
+    wq->head->wqprev = p;
+  wq->head = p;
   p->state = SLEEPING;
+  release(&wq->lock);
 
   sched();
 
-  // Tidy up.
+  // Tidy up. the wait queue's lock comes before p->lock.
+  release(&p->lock);
+  acquire(&wq->lock);
+  if(p->wqprev)
+    p->wqprev->wqnext = p->wqnext;
+  else
+    wq->head = p->wqnext;
+  if(p->wqnext)
+    p->wqnext->wqprev = p->wqprev;
   p->chan = 0;
+  release(&wq->lock);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
@@ -566,17 +1191,22 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
+  struct waitq *wq = chan2waitq(chan);
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  acquire(&wq->lock);
+  for(p = wq->head; p; p = p->wqnext) {
+    // other channels can hash to the same list, but p->chan
+    // can't change while we hold the list's lock.
+    if(p->chan == chan){
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+      if(p->state == SLEEPING) {
+        setrunnable(p, p->cpu);
       }
       release(&p->lock);
     }
   }
+  release(&wq->lock);
 }
 
 // Kill the process with the given pid.
@@ -587,20 +1217,23 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+  if((p = findproc(pid)) == 0)
+    return -1;
+  acquire(&p->lock);
+  if(p->pid != pid){
+    // waited for since findproc().
     release(&p->lock);
+    procput(p);
+    return -1;
+  }
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    setrunnable(p, p->cpu);
   }
-  return -1;
+  release(&p->lock);
+  procput(p);
+  return 0;
 }
 
 void
@@ -670,31 +1303,82 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
-    if(p->state == UNUSED)
-      continue;
-    if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
-      state = states[p->state];
-    else
-      state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
-    printf("\n");
+  for(int i = 0; i < NPIDHASH; i++){
+    for(p = pidhash[i].head; p; p = p->pidnext){
+      if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
+        state = states[p->state];
+      else
+        state = "???";
+      printf("%d %s %s", p->pid, state, p->name);
+      printf("\n");
+    }
   }
 }
 
-// Find a process by PID
-struct proc*
-findproc(int pid)
+// Set the nice value of the process with the given pid,
+// or of the current process if pid is 0. The new weight
+// applies to the process's run time from now on.
+int
+setpriority(int pid, int nice)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
-    acquire(&p->lock);
-    if(p->pid == pid && p->state != UNUSED) {
-      release(&p->lock);
-      return p;
-    }
+  if(nice < NICEMIN || nice > NICEMAX)
+    return -1;
+  if(pid == 0)
+    pid = myproc()->pid;
+  if((p = findproc(pid)) == 0)
+    return -1;
+  acquire(&p->lock);
+  if(p->pid != pid){
     release(&p->lock);
+    procput(p);
+    return -1;
   }
+  // charge the time so far at the old weight.
+  if(p == myproc())
+    account(p);
+  p->nice = nice;
+  release(&p->lock);
+  procput(p);
   return 0;
 }
+
+// Return the pid of the current process's parent.
+int
+getppid(void)
+{
+  int pid;
+
+  // exit() can reparent us to init at any time.
+  acquire(&wait_lock);
+  pid = myproc()->parent->pid;
+  release(&wait_lock);
+  return pid;
+}
+
+// Find the process with the given pid, or return 0.
+// Returns a reference to the process, which keeps its struct
+// proc from being freed; drop it with procput(). Doesn't lock
+// the process, so that the caller can lock several in a
+// consistent order. The process may exit and be waited for
+// as soon as findproc() returns, but a pid is never reused,
+// so it works as a generation number: after acquiring
+// p->lock, check that p->pid is still pid.
+struct proc*
+findproc(int pid)
+{
+  struct pidhash *h = &pidhash[pid % NPIDHASH];
+  struct proc *p;
+
+  if(pid <= 0)
+    return 0;
+  acquire(&h->lock);
+  for(p = h->head; p; p = p->pidnext)
+    if(p->pid == pid)
+      break;
+  if(p)
+    __sync_fetch_and_add(&p->ref, 1);
+  release(&h->lock);
+  return p;
+}
@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // Waiting in scheduler() for something to run?
+  pagetable_t upt;            // User page table in use, or 0 if in the kernel
+  uint64 ntrap;               // Number of traps from user space
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +82,13 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of a process's mmap area (see vm.c).
+struct vma {
+  uint64 start;                // First address, or 0 if slot is free
+  uint64 end;                  // One past the last address
+  int shmid;                   // Shared-memory segment, or -1
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -87,17 +97,51 @@ struct proc {
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // CPU it last ran on, or is queued to run on
+  uint64 tlbstale;             // CPUs that must flush kstack from their TLB
+  int nice;                    // Scheduling priority, NICEMIN to NICEMAX
+  int slice;                   // Timer ticks left in its time slice
+  uint64 runstart;             // When its run time was last accounted
+  uint64 vruntime;             // Run time, scaled down by its weight
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next process in the run queue
+
+  // the wait queue's lock must be held when using these:
+  void *chan;                  // If non-zero, sleeping on chan
+  struct proc *wqnext;         // Others sleeping on chans with the same hash
+  struct proc *wqprev;
 
-  // wait_lock must be held when using this:
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *children;       // First of its children
+  struct proc *sibling;        // Next child of the same parent
+
+  // the pid hash bucket's lock must be held when using this:
+  struct proc *pidnext;        // Next process with the same pid hash
+
+  // p->lock must be held to use these, since map_shared_pages()
+  // can change another process's mmap area. Threads share
+  // their leader's, and hold the leader's lock:
+  struct vma vma[NVMA];        // Regions of the mmap area
+  int nthread;                 // Number of threads, counting the leader
+  int threadmask;              // Which THREADFRAME slots are in use
+
+  // shmtab.lock must be held to use this (see shm.c):
+  char shmopen[NSHM];          // Segments opened but not yet attached
+
+  int ref;                     // References; changed with atomic instructions
+  int slot;                    // Where its kernel stack is mapped
+  struct proc *leader;         // First thread of its address space, maybe itself
+  int tslot;                   // Its trapframe is mapped at THREADFRAME(tslot)
+  uint64 tfva;                 // = THREADFRAME(tslot), for sscratch
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
-  uint64 sz;                   // Size of process memory (bytes)
+  uint64 sz;                   // Size of process memory (bytes); threads use the leader's
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
@@ -0,0 +1,239 @@
+//
+// Named shared-memory segments.
+//
+// A segment is a set of physical pages identified by a key.
+// Any process can look a segment up by key with shm_open(),
+// attach it to its address space with shm_attach(), and
+// detach it with shm_detach(); it need not know the pid of
+// whoever created it. A segment is freed when the last
+// process that attached it detaches (or exits).
+//
+// shm_open() gives the process a reference too, so that the
+// segment can't be freed, and its id reused for another key,
+// before the process gets around to attaching it. The first
+// shm_attach() takes that reference over; a process that
+// exits without attaching drops it (see shmclose).
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+
+struct shmseg {
+  int key;
+  int used;                    // is this slot in use?
+  int creating;                // pages still being allocated?
+  int refcnt;                  // attachments, plus openers not yet attached
+  uint64 npages;
+  uint64 pages[SHMMAXPAGES];   // physical pages
+};
+
+struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+} shmtab;
+
+void
+shminit(void)
+{
+  initlock(&shmtab.lock, "shmtab");
+}
+
+// Free the pages of a segment that is no longer attached.
+// Caller must hold shmtab.lock.
+static void
+shmfree(struct shmseg *s)
+{
+  for(int i = 0; i < s->npages; i++)
+    kfree((void*)s->pages[i]);
+  s->npages = 0;
+  s->key = 0;
+  s->used = 0;
+}
+
+// Return the id of the segment with the given key, creating
+// it with size bytes of zeroed memory if it doesn't exist,
+// and give p (a leader) a reference to it.
+// Returns -1 if an existing segment is smaller than size,
+// or if the table or memory is exhausted.
+int
+shmopen(struct proc *p, int key, uint64 size)
+{
+  struct shmseg *s, *free;
+  uint64 npages = PGROUNDUP(size) / PGSIZE;
+  char *mem;
+  int id;
+
+  if(npages == 0 || npages > SHMMAXPAGES)
+    return -1;
+
+  acquire(&shmtab.lock);
+again:
+  free = 0;
+  for(s = shmtab.seg; s < &shmtab.seg[NSHM]; s++){
+    if(s->used && s->key == key){
+      if(s->creating){
+        // someone else is creating it; wait and look again.
+        sleep(s, &shmtab.lock);
+        goto again;
+      }
+      id = s - shmtab.seg;
+      if(npages > s->npages){
+        release(&shmtab.lock);
+        return -1;
+      }
+      if(!p->shmopen[id]){
+        p->shmopen[id] = 1;
+        s->refcnt++;
+      }
+      release(&shmtab.lock);
+      return id;
+    }
+    if(!s->used && free == 0)
+      free = s;
+  }
+  if((s = free) == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+
+  // claim the slot, then zero the pages without holding the
+  // lock; s->creating keeps everyone else off the segment.
+  s->used = 1;
+  s->creating = 1;
+  s->key = key;
+  s->refcnt = 1;
+  s->npages = 0;
+  release(&shmtab.lock);
+  for(; s->npages < npages; s->npages++){
+    if((mem = kzalloc()) == 0)
+      break;
+    s->pages[s->npages] = (uint64)mem;
+  }
+
+  acquire(&shmtab.lock);
+  s->creating = 0;
+  wakeup(s);
+  if(s->npages < npages){
+    shmfree(s);
+    release(&shmtab.lock);
+    return -1;
+  }
+  id = s - shmtab.seg;
+  p->shmopen[id] = 1;
+  release(&shmtab.lock);
+  return id;
+}
+
+// Drop the references p (a leader) holds to segments it
+// opened but never attached, as it exits.
+void
+shmclose(struct proc *p)
+{
+  struct shmseg *s;
+
+  acquire(&shmtab.lock);
+  for(int id = 0; id < NSHM; id++){
+    if(!p->shmopen[id])
+      continue;
+    p->shmopen[id] = 0;
+    s = &shmtab.seg[id];
+    if(--s->refcnt == 0)
+      shmfree(s);
+  }
+  release(&shmtab.lock);
+}
+
+// Add a reference to segment id, for a new attachment.
+void
+shmdup(int id)
+{
+  acquire(&shmtab.lock);
+  if(!shmtab.seg[id].used || shmtab.seg[id].refcnt < 0)
+    panic("shmdup");
+  shmtab.seg[id].refcnt++;
+  release(&shmtab.lock);
+}
+
+// Drop a reference to segment id, freeing it when the
+// last attachment goes away.
+void
+shmput(int id)
+{
+  struct shmseg *s = &shmtab.seg[id];
+
+  acquire(&shmtab.lock);
+  if(!s->used || s->refcnt < 1)
+    panic("shmput");
+  if(--s->refcnt == 0)
+    shmfree(s);
+  release(&shmtab.lock);
+}
+
+// Attach segment id to p's mmap area at virtual address va,
+// or at an address of the kernel's choosing if va is 0.
+// A chosen va must be page-aligned, lie above the heap, and
+// not overlap another mapping.
+// Returns the address, or -1.
+uint64
+shmattach(struct proc *p, int id, uint64 va)
+{
+  struct shmseg *s;
+  struct vma *v;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shmtab.seg[id];
+  acquire(&shmtab.lock);
+  if(!s->used || s->creating){
+    release(&shmtab.lock);
+    return -1;
+  }
+  // take over the reference from shm_open(), if p has one.
+  if(p->shmopen[id])
+    p->shmopen[id] = 0;
+  else
+    s->refcnt++;
+  release(&shmtab.lock);
+
+  // the segment's pages can't change while we hold a reference.
+  acquire(&p->lock);
+  if((v = vmacreate(p, va, s->npages*PGSIZE, 0, id)) == 0){
+    release(&p->lock);
+    shmput(id);
+    return -1;
+  }
+  for(int i = 0; i < s->npages; i++){
+    kdup((void*)s->pages[i]);
+    if(mappages(p->pagetable, v->start + i*PGSIZE, PGSIZE, s->pages[i],
+                PTE_R | PTE_W | PTE_U | PTE_S) != 0){
+      kfree((void*)s->pages[i]);
+      vmaremove(p, v, v->start, v->end);
+      release(&p->lock);
+      return -1;
+    }
+  }
+  va = v->start;
+  release(&p->lock);
+  return va;
+}
+
+// Detach the segment attached at va from p.
+// Returns 0, or -1 if no segment is attached there.
+int
+shmdetach(struct proc *p, uint64 va)
+{
+  struct vma *v;
+  int ret = -1;
+
+  acquire(&p->lock);
+  v = vmalookup(p, va);
+  if(v && v->shmid >= 0 && v->start == va)
+    ret = vmaremove(p, v, v->start, v->end);
+  release(&p->lock);
+  return ret;
+}
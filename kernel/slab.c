@@ -0,0 +1,260 @@
+//
+// Allocator for small kernel objects (pipes, open files,
+// in-memory inodes) that would waste most of a page each.
+//
+// kmalloc() rounds a request up to one of a few size classes.
+// Each class has a cache of slabs: pages carved into objects
+// of that size, with a header at the start of the page, so
+// kmfree() finds an object's slab by rounding its address
+// down. Each CPU also keeps a magazine of free objects of
+// each class, with its own lock that only kslabreclaim()
+// ever contends for; the slabs and their lock are only
+// touched to refill or drain a magazine.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+struct obj {
+  struct obj *next;
+};
+
+struct kcache;
+
+// at the start of each slab's page.
+struct slab {
+  struct kcache *cache;
+  struct slab *next;     // cache's list of slabs with free objects
+  struct slab *prev;
+  struct obj *free;      // this slab's free objects
+  int nfree;
+};
+
+#define MAGSIZE 16
+
+struct magazine {
+  struct spinlock lock;
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kcache {
+  struct spinlock lock;  // protects the slabs
+  uint size;
+  uint nobj;             // objects per slab
+  struct slab *partial;  // slabs with free objects
+  struct magazine mag[NCPU];
+};
+
+// sizes are multiples of 16, so objects are 16-byte aligned.
+static uint sizes[] = { 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1344 };
+#define NCACHE (sizeof(sizes)/sizeof(sizes[0]))
+
+static struct kcache caches[NCACHE];
+
+void
+slabinit(void)
+{
+  struct kcache *c;
+
+  for(int i = 0; i < NCACHE; i++){
+    c = &caches[i];
+    initlock(&c->lock, "slab");
+    c->size = sizes[i];
+    c->nobj = (PGSIZE - sizeof(struct slab)) / c->size;
+    for(int j = 0; j < NCPU; j++)
+      initlock(&c->mag[j].lock, "magazine");
+  }
+}
+
+static void
+slablink(struct kcache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+slabunlink(struct kcache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Make page pg a slab of free objects for c.
+// Caller must hold c->lock.
+static void
+slabnew(struct kcache *c, char *pg)
+{
+  struct slab *s = (struct slab*)pg;
+  char *p;
+
+  s->cache = c;
+  s->free = 0;
+  // the objects fill the end of the page, so that they are
+  // aligned like the page's end.
+  for(p = pg + PGSIZE - c->nobj*c->size; p < pg + PGSIZE; p += c->size){
+    ((struct obj*)p)->next = s->free;
+    s->free = (struct obj*)p;
+  }
+  s->nfree = c->nobj;
+  slablink(c, s);
+}
+
+// Take up to n objects from c's slabs into obj[], adding a
+// slab if there are none. Returns the number taken.
+static int
+slabget(struct kcache *c, void **obj, int n)
+{
+  struct slab *s;
+  struct obj *o;
+  char *pg;
+  int i;
+
+  acquire(&c->lock);
+  if(c->partial == 0){
+    // kalloc() may call kslabreclaim(), which takes c->lock.
+    release(&c->lock);
+    if((pg = kalloc()) == 0)
+      return 0;
+    acquire(&c->lock);
+    slabnew(c, pg);
+  }
+  for(i = 0; i < n && (s = c->partial) != 0; i++){
+    o = s->free;
+    s->free = o->next;
+    if(--s->nfree == 0)
+      slabunlink(c, s);
+    obj[i] = o;
+  }
+  release(&c->lock);
+  return i;
+}
+
+// Return n objects to their slabs in c, freeing slabs
+// that end up with no objects in use.
+static void
+slabput(struct kcache *c, void **obj, int n)
+{
+  struct slab *s;
+  struct obj *o;
+
+  acquire(&c->lock);
+  for(int i = 0; i < n; i++){
+    o = obj[i];
+    s = (struct slab*)PGROUNDDOWN((uint64)o);
+    o->next = s->free;
+    s->free = o;
+    if(s->nfree++ == 0)
+      slablink(c, s);
+    if(s->nfree == c->nobj){
+      slabunlink(c, s);
+      kfree(s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate n bytes. Requests too big for the largest size
+// class get a whole page, so n can't be more than PGSIZE.
+// The memory is not zeroed.
+// Returns 0 if out of memory.
+void *
+kmalloc(uint64 n)
+{
+  struct kcache *c;
+  struct magazine *m;
+  void *obj[MAGSIZE/2], *p = 0;
+  int i, got;
+
+  for(i = 0; i < NCACHE && sizes[i] < n; i++)
+    ;
+  if(i == NCACHE)
+    return n <= PGSIZE ? kalloc() : 0;
+  c = &caches[i];
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n > 0)
+    p = m->obj[--m->n];
+  release(&m->lock);
+  if(p == 0 && (got = slabget(c, obj, MAGSIZE/2)) > 0){
+    // keep the rest for next time.
+    p = obj[--got];
+    acquire(&m->lock);
+    while(got > 0 && m->n < MAGSIZE)
+      m->obj[m->n++] = obj[--got];
+    release(&m->lock);
+    if(got > 0)
+      slabput(c, obj, got);
+  }
+  pop_off();
+  return p;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  struct kcache *c;
+  struct magazine *m;
+  void *obj[MAGSIZE/2];
+  int n = 0;
+
+  // only whole pages are page-aligned; objects come after
+  // their slab's header.
+  if((uint64)p % PGSIZE == 0){
+    kfree(p);
+    return;
+  }
+  c = ((struct slab*)PGROUNDDOWN((uint64)p))->cache;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE){
+    // full; send half back to the slabs.
+    while(n < MAGSIZE/2)
+      obj[n++] = m->obj[--m->n];
+  }
+  m->obj[m->n++] = p;
+  release(&m->lock);
+  if(n > 0)
+    slabput(c, obj, n);
+  pop_off();
+}
+
+// Empty every CPU's magazines into the slabs, so that slabs
+// with no objects in use go back to the page allocator.
+// kalloc() calls this when it runs out of pages.
+void
+kslabreclaim(void)
+{
+  struct kcache *c;
+  struct magazine *m;
+  void *obj[MAGSIZE];
+  int n;
+
+  for(c = caches; c < &caches[NCACHE]; c++){
+    for(m = c->mag; m < &c->mag[NCPU]; m++){
+      acquire(&m->lock);
+      for(n = 0; m->n > 0; n++)
+        obj[n] = m->obj[--m->n];
+      release(&m->lock);
+      if(n > 0)
+        slabput(c, obj, n);
+    }
+  }
+}
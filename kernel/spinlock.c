@@ -6,14 +6,101 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "proc.h"
+#include "lockstat.h"
 #include "defs.h"
 
+// Locks are grouped into classes by name (e.g. every process's
+// p->lock is a "proc"), so that lockstat() can report how
+// contended each kind of lock is. A class keeps a list of its
+// locks, however many there are; a lock in memory that gets
+// freed (e.g. a pipe's) must be taken out with freelock()
+// first, which adds its counts to the class's. Only the
+// number of names is limited: locks with names beyond
+// NLOCKCLASS just aren't reported.
+#define LOCKNAME 16  // as in struct lockstat
+
+struct lockclass {
+  char *name;               // 0 if the slot is unused
+  int nlock;                // number of locks on the list
+  struct spinlock *locks;   // through lk->next and lk->prev
+  uint64 nacquire, nspin;   // counts of freed locks
+};
+
+struct {
+  struct spinlock lock;
+  struct lockclass class[NLOCKCLASS];  // hashed by name
+} locktab;
+
+// Find name's class, adding it if it's new.
+// Returns 0 if the table is full.
+static struct lockclass *
+lockclass(char *name)
+{
+  uint h = 0;
+  struct lockclass *c;
+
+  for(int i = 0; i < LOCKNAME && name[i]; i++)
+    h = h*31 + name[i];
+  for(int i = 0; i < NLOCKCLASS; i++){
+    c = &locktab.class[(h + i) % NLOCKCLASS];
+    if(c->name == 0){
+      c->name = name;
+      return c;
+    }
+    if(c->name == name || strncmp(c->name, name, LOCKNAME) == 0)
+      return c;
+  }
+  return 0;
+}
+
 void
 initlock(struct spinlock *lk, char *name)
 {
+  struct lockclass *c;
+
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->nacquire = 0;
+  lk->nspin = 0;
+  lk->class = 0;
+
+  // locktab.lock starts out zeroed, which is enough to use it.
+  if(lk == &locktab.lock)
+    return;
+  acquire(&locktab.lock);
+  if((c = lockclass(name)) != 0){
+    lk->class = c;
+    lk->prev = 0;
+    lk->next = c->locks;
+    if(c->locks)
+      c->locks->prev = lk;
+    c->locks = lk;
+    c->nlock++;
+  }
+  release(&locktab.lock);
+}
+
+// Forget about lk, which is about to be freed.
+void
+freelock(struct spinlock *lk)
+{
+  struct lockclass *c;
+
+  acquire(&locktab.lock);
+  if((c = lk->class) != 0){
+    c->nacquire += lk->nacquire;
+    c->nspin += lk->nspin;
+    if(lk->prev)
+      lk->prev->next = lk->next;
+    else
+      c->locks = lk->next;
+    if(lk->next)
+      lk->next->prev = lk->prev;
+    c->nlock--;
+    lk->class = 0;
+  }
+  release(&locktab.lock);
 }
 
 // Acquire the lock.
@@ -21,6 +108,8 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint64 spins = 0;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
@@ -30,7 +119,7 @@ acquire(struct spinlock *lk)
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
   while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+    spins++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -40,6 +129,8 @@ acquire(struct spinlock *lk)
 
   // Record info about lock acquisition for holding() and debugging.
   lk->cpu = mycpu();
+  lk->nacquire++;
+  lk->nspin += spins;
 }
 
 // Release the lock.
@@ -108,3 +199,39 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+// Fill in ls with the counts for the i'th lock class, summed
+// over its locks, live and freed. If reset, zero those counts.
+// Returns 0, or -1 if there are fewer than i+1 classes.
+// The counts are read without holding the locks, so they
+// can be a little off.
+int
+lockstat(int i, struct lockstat *ls, int reset)
+{
+  struct lockclass *c;
+  struct spinlock *lk;
+  int ret = -1;
+
+  memset(ls, 0, sizeof(*ls));
+  acquire(&locktab.lock);
+  for(c = locktab.class; c < &locktab.class[NLOCKCLASS]; c++){
+    if(c->name == 0 || i-- > 0)
+      continue;
+    safestrcpy(ls->name, c->name, sizeof(ls->name));
+    ls->nlock = c->nlock;
+    ls->nacquire = c->nacquire;
+    ls->nspin = c->nspin;
+    if(reset)
+      c->nacquire = c->nspin = 0;
+    for(lk = c->locks; lk; lk = lk->next){
+      ls->nacquire += lk->nacquire;
+      ls->nspin += lk->nspin;
+      if(reset)
+        lk->nacquire = lk->nspin = 0;
+    }
+    ret = 0;
+    break;
+  }
+  release(&locktab.lock);
+  return ret;
+}
@@ -5,5 +5,11 @@ struct spinlock {
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // For profiling (see lockstat):
+  uint64 nacquire;   // number of acquire()s
+  uint64 nspin;      // times acquire() found it held and had to retry
+  struct lockclass *class;       // locks with the same name, or 0
+  struct spinlock *next, *prev;  // on class's list
 };
 
@@ -10,10 +10,12 @@ void timerinit();
 // entry.S needs one stack per CPU.
 __attribute__ ((aligned (16))) char stack0[4096 * NCPU];
 
-// a scratch area per CPU for machine-mode timer interrupts.
-uint64 timer_scratch[NCPU][5];
+// a scratch area per CPU for machine-mode timer and
+// software interrupts.
+uint64 timer_scratch[NCPU][7];
 
-// assembly code in kernelvec.S for machine-mode timer interrupt.
+// assembly code in kernelvec.S for machine-mode timer and
+// software interrupts.
 extern void timervec();
 
 // entry.S jumps here in machine mode on stack0.
@@ -46,6 +48,10 @@ start()
   // ask for clock interrupts.
   timerinit();
 
+  // allow supervisor mode to read the time CSR, which the
+  // scheduler uses to measure run time.
+  w_mcounteren(r_mcounteren() | 2);
+
   // keep each CPU's hartid in its tp register, for cpuid().
   int id = r_mhartid();
   w_tp(id);
@@ -54,7 +60,8 @@ start()
   asm volatile("mret");
 }
 
-// arrange to receive timer interrupts.
+// arrange to receive timer interrupts, and interrupts
+// from other harts' ipi().
 // they will arrive in machine mode at
 // at timervec in kernelvec.S,
 // which turns them into software interrupts for
@@ -73,9 +80,13 @@ timerinit()
   // scratch[0..2] : space for timervec to save registers.
   // scratch[3] : address of CLINT MTIMECMP register.
   // scratch[4] : desired interval (in cycles) between timer interrupts.
+  // scratch[5] : set by timervec on a timer interrupt, for devintr().
+  // scratch[6] : address of CLINT MSIP register.
   uint64 *scratch = &timer_scratch[id][0];
   scratch[3] = CLINT_MTIMECMP(id);
   scratch[4] = interval;
+  scratch[5] = 0;
+  scratch[6] = CLINT_MSIP(id);
   w_mscratch((uint64)scratch);
 
   // set the machine-mode trap handler.
@@ -84,6 +95,6 @@ timerinit()
   // enable machine-mode interrupts.
   w_mstatus(r_mstatus() | MSTATUS_MIE);
 
-  // enable machine-mode timer interrupts.
-  w_mie(r_mie() | MIE_MTIE);
+  // enable machine-mode timer and software interrupts.
+  w_mie(r_mie() | MIE_MTIE | MIE_MSIE);
 }
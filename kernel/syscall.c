@@ -11,7 +11,7 @@
 int
 fetchaddr(uint64 addr, uint64 *ip)
 {
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;  // threads share its memory
   if(addr >= p->sz || addr+sizeof(uint64) > p->sz) // both tests needed, in case of overflow
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
@@ -104,6 +104,18 @@ extern uint64 sys_close(void);
 extern uint64 sys_map_shared_pages(void);
 extern uint64 sys_unmap_shared_pages(void);
 extern uint64 sys_getppid(void);
+extern uint64 sys_shm_open(void);
+extern uint64 sys_shm_attach(void);
+extern uint64 sys_shm_detach(void);
+extern uint64 sys_lockstat(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
+extern uint64 sys_bstat(void);
+extern uint64 sys_setreadahead(void);
+extern uint64 sys_dropcache(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -131,6 +143,18 @@ static uint64 (*syscalls[])(void) = {
 [SYS_map_shared_pages] sys_map_shared_pages,
 [SYS_unmap_shared_pages] sys_unmap_shared_pages,
 [SYS_getppid] sys_getppid,
+[SYS_shm_open]   sys_shm_open,
+[SYS_shm_attach] sys_shm_attach,
+[SYS_shm_detach] sys_shm_detach,
+[SYS_lockstat]   sys_lockstat,
+[SYS_setpriority] sys_setpriority,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_bstat]      sys_bstat,
+[SYS_setreadahead] sys_setreadahead,
+[SYS_dropcache]  sys_dropcache,
 };
 
 void
@@ -22,4 +22,16 @@
 #define SYS_close  21
 #define SYS_map_shared_pages 22 // added for task 1
 #define SYS_unmap_shared_pages 23 // added for task 1
-#define SYS_getppid 24 // added for task 1
\ No newline at end of file
+#define SYS_getppid 24 // added for task 1
+#define SYS_shm_open   25
+#define SYS_shm_attach 26
+#define SYS_shm_detach 27
+#define SYS_lockstat   28
+#define SYS_setpriority 29
+#define SYS_clone  30
+#define SYS_join   31
+#define SYS_futex_wait 32
+#define SYS_futex_wake 33
+#define SYS_bstat      34
+#define SYS_setreadahead 35
+#define SYS_dropcache  36
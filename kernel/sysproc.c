@@ -5,6 +5,8 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "lockstat.h"
+#include "bstat.h"
 
 uint64
 sys_exit(void)
@@ -42,8 +44,7 @@ sys_sbrk(void)
   int n;
 
   argint(0, &n);
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
+  if(growproc(n, &addr) < 0)
     return -1;
   return addr;
 }
@@ -95,48 +96,48 @@ sys_map_shared_pages(void)
 {
   int src_pid, dst_pid;
   uint64 src_va, size;
-  struct proc *src_proc, *dst_proc;
-  uint64 ret;
+  struct proc *src_proc, *dst_proc, *p1, *p2;
+  uint64 ret = -1;
   
   argint(0, &src_pid);
   argint(1, &dst_pid);
   argaddr(2, &src_va);
   argaddr(3, &size);
   
-  src_proc = findproc(src_pid);
-  if(src_proc == 0)
+  if((src_proc = findproc(src_pid)) == 0)
     return -1;
-
-  dst_proc = findproc(dst_pid);
-  if(dst_proc == 0)
+  if((dst_proc = findproc(dst_pid)) == 0){
+    procput(src_proc);
     return -1;
-
-  // Acquire locks in a consistent order to prevent deadlock
-  // For simplicity, we'll lock src_proc then dst_proc if different.
-  // A more robust way is to lock based on PID or address.
-  // This simple order works if src_proc and dst_proc are always different
-  // or if map_shared_pages handles the case where they are the same
-  // (which it doesn't currently, but it's not a typical use case for this API).
-
-  // For a more robust locking order:
-  struct proc *p1 = src_proc, *p2 = dst_proc;
-  if ((uint64)p1 > (uint64)p2) { // Ensure p1 has a lower memory address than p2
-    struct proc *tmp = p1;
-    p1 = p2;
-    p2 = tmp;
   }
 
+  // lock the processes in address order, to avoid deadlock
+  // with another call locking the same two.
+  p1 = src_proc;
+  p2 = dst_proc;
+  if(p1 > p2){
+    p1 = dst_proc;
+    p2 = src_proc;
+  }
   acquire(&p1->lock);
-  if (p1 != p2) { // Only acquire second lock if processes are different
+  if(p1 != p2)
     acquire(&p2->lock);
-  }
 
-  ret = map_shared_pages(src_proc, dst_proc, src_va, size);
+  // either may have been waited for since findproc(). the
+  // address spaces belong to leaders, not other threads.
+  if(src_proc->pid == src_pid && dst_proc->pid == dst_pid &&
+     src_proc->leader == src_proc && dst_proc->leader == dst_proc)
+    ret = map_shared_pages(src_proc, dst_proc, src_va, size);
 
-  if (p1 != p2) {
+  if(p1 != p2)
     release(&p2->lock);
-  }
   release(&p1->lock);
+  // the source's pages are shared now, so waiters on them
+  // need new futex keys.
+  if(ret != -1)
+    futex_share(src_proc, PGROUNDDOWN(src_va), PGROUNDUP(src_va + size));
+  procput(src_proc);
+  procput(dst_proc);
     
   return ret;
 }
@@ -145,7 +146,7 @@ uint64
 sys_unmap_shared_pages(void)
 {
   uint64 addr, size;
-  struct proc *p = myproc();
+  struct proc *p = myproc()->leader;
   uint64 ret;
   
   argaddr(0, &addr);
@@ -161,5 +162,142 @@ sys_unmap_shared_pages(void)
 uint64
 sys_getppid(void)
 {
-  return myproc()->parent->pid;
+  return getppid();
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+
+  argint(0, &tid);
+  return join(tid);
+}
+
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int expected;
+
+  argaddr(0, &addr);
+  argint(1, &expected);
+  return futex_wait(addr, expected);
+}
+
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return futex_wake(addr, n);
+}
+
+uint64
+sys_shm_open(void)
+{
+  int key;
+  uint64 size;
+
+  argint(0, &key);
+  argaddr(1, &size);
+  return shmopen(myproc()->leader, key, size);
+}
+
+uint64
+sys_shm_attach(void)
+{
+  int id;
+  uint64 va;
+
+  argint(0, &id);
+  argaddr(1, &va);
+  return shmattach(myproc()->leader, id, va);
+}
+
+uint64
+sys_shm_detach(void)
+{
+  uint64 va;
+
+  argaddr(0, &va);
+  return shmdetach(myproc()->leader, va);
+}
+
+// Copy out the contention counts for the i'th kind of lock
+// (see lockstat in spinlock.c), optionally zeroing them.
+// Returns -1 once i runs past the last kind.
+uint64
+sys_lockstat(void)
+{
+  int i, reset;
+  uint64 addr;
+  struct lockstat ls;
+
+  argint(0, &i);
+  argaddr(1, &addr);
+  argint(2, &reset);
+  if(lockstat(i, &ls, reset) < 0)
+    return -1;
+  if(copyout(myproc()->pagetable, addr, (char*)&ls, sizeof(ls)) < 0)
+    return -1;
+  return 0;
+}
+
+// Copy out the buffer cache's hit and miss counts.
+uint64
+sys_bstat(void)
+{
+  uint64 addr;
+  struct bstat st;
+
+  argaddr(0, &addr);
+  bstat(&st);
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+// Set the number of blocks read ahead of sequential file
+// reads (not changing it if negative); returns the old number.
+uint64
+sys_setreadahead(void)
+{
+  int n;
+
+  argint(0, &n);
+  return setreadahead(n);
+}
+
+// Empty the buffer cache of blocks not in use, so that
+// benchmarks can start cold.
+uint64
+sys_dropcache(void)
+{
+  bdrop();
+  return 0;
+}
+
+uint64
+sys_setpriority(void)
+{
+  int pid, nice;
+
+  argint(0, &pid);
+  argint(1, &nice);
+  return setpriority(pid, nice);
 }
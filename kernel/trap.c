@@ -16,6 +16,9 @@ void kernelvec();
 
 extern int devintr();
 
+// in start.c, shared with timervec.
+extern uint64 timer_scratch[NCPU][7];
+
 void
 trapinit(void)
 {
@@ -45,6 +48,12 @@ usertrap(void)
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
 
+  // the trampoline flushed the user page table's entries from
+  // the TLB; tell tlbshootdown().
+  struct cpu *c = mycpu();
+  c->upt = 0;
+  c->ntrap++;
+
   struct proc *p = myproc();
   
   // save user program counter.
@@ -65,6 +74,10 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p, r_stval(), r_scause() == 15) != 0){
+    // load or store page fault on a lazily allocated
+    // heap page or a copy-on-write page; it's mapped now.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -76,9 +89,10 @@ usertrap(void)
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
+  // give up the CPU if this is a timer interrupt
+  // and the process's time slice is up.
   if(which_dev == 2)
-    yield();
+    preempt();
 
   usertrapret();
 }
@@ -119,8 +133,15 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
+  // tell trampoline.S the user page table to switch to,
+  // and where this thread's trapframe is in it.
   uint64 satp = MAKE_SATP(p->pagetable);
+  w_sscratch(p->tfva);
+
+  // from here until the next trap, this CPU may cache
+  // translations from the user page table.
+  mycpu()->upt = p->pagetable;
+  __sync_synchronize();
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -150,9 +171,10 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
+  // give up the CPU if this is a timer interrupt
+  // and the process's time slice is up.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    preempt();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -160,6 +182,16 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
+// Interrupt hart with a supervisor software interrupt, via
+// its machine-mode software interrupt (see timervec).
+// Used to wake a hart waiting in the scheduler, and to
+// get one out of user space (see tlbshootdown).
+void
+ipi(int hart)
+{
+  *(volatile uint32*)CLINT_MSIP(hart) = 1;
+}
+
 void
 clockintr()
 {
@@ -202,17 +234,23 @@ devintr()
 
     return 1;
   } else if(scause == 0x8000000000000001L){
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or another hart's ipi(), forwarded by timervec in
+    // kernelvec.S.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+    // an ipi() is only meant to wake up the scheduler, or
+    // to bring the hart into the kernel.
+    if(__sync_lock_test_and_set(&timer_scratch[cpuid()][5], 0) == 0)
+      return 1;
+
+    if(cpuid() == 0){
+      clockintr();
+    }
+
     return 2;
   } else {
     return 0;
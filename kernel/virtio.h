@@ -46,8 +46,12 @@
 #define VIRTIO_RING_F_EVENT_IDX     29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two. each request takes three, so
+// a whole log's worth of writes can be in flight at once.
+#define NUM 128
+
+// most blocks to merge into one request.
+#define MAXSEG 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -42,12 +42,29 @@ static struct disk {
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
+  // requests not yet in the avail ring, so that a request
+  // for the next block can still be merged into the last one
+  // (see submit). kick() hands them to the device.
+  uint16 pending[NUM];
+  int npending;
+
+  // requests given to the device, and the blocks they
+  // covered, since boot (see bstat).
+  uint64 nreq, nblock;
+
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
+  // a request covers nbuf blocks with consecutive numbers,
+  // in buffers linked through b->dnext.
   struct {
     struct buf *b;
+    struct buf *last;
+    int nbuf;
+    int tail;       // descriptor for last's data
+    char write;
     char status;
+    char readahead; // no one waits; pass each buf to breaddone()
   } info[NUM];
 
   // disk command headers.
@@ -212,16 +229,83 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// Tell the device about the requests added to the avail
+// ring since the last time, with one notification.
+// Caller must hold vdisk_lock.
+static void
+kick(void)
+{
+  if(disk.npending == 0)
+    return;
+
+  // tell the device the first index in each chain of descriptors.
+  for(int i = 0; i < disk.npending; i++)
+    disk.avail->ring[(disk.avail->idx + i) % NUM] = disk.pending[i];
+
+  __sync_synchronize();
+
+  // tell the device more avail ring entries are available.
+  disk.avail->idx += disk.npending; // not % NUM ...
+  disk.npending = 0;
+
+  __sync_synchronize();
+
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+}
+
+// If the last request not yet handed to the device has the
+// same kind and ends at the block before b's, add b to it,
+// with one more data descriptor, and return 1.
+// Caller must hold vdisk_lock.
+static int
+merge(struct buf *b, int write, int readahead)
+{
+  int id, d;
+
+  if(disk.npending == 0)
+    return 0;
+  id = disk.pending[disk.npending - 1];
+  if(disk.info[id].write != write || disk.info[id].readahead != readahead ||
+     disk.info[id].nbuf >= MAXSEG || disk.info[id].last->dev != b->dev ||
+     disk.info[id].last->blockno + 1 != b->blockno)
+    return 0;
+  if((d = alloc_desc()) < 0)
+    return 0;
+
+  // splice d in between the last data descriptor and the
+  // status descriptor.
+  disk.desc[d].addr = (uint64) b->data;
+  disk.desc[d].len = BSIZE;
+  disk.desc[d].flags = (write ? 0 : VRING_DESC_F_WRITE) | VRING_DESC_F_NEXT;
+  disk.desc[d].next = disk.desc[disk.info[id].tail].next;
+  disk.desc[disk.info[id].tail].next = d;
+  disk.info[id].tail = d;
+
+  b->disk = 1;
+  b->dnext = 0;
+  disk.info[id].last->dnext = b;
+  disk.info[id].last = b;
+  disk.info[id].nbuf++;
+  disk.nblock++;
+  return 1;
+}
+
+// Queue a request to read or write b; the device starts on
+// it at the next kick(). If readahead is set, return -1
+// rather than wait for free descriptors.
+// Caller must hold vdisk_lock.
+static int
+submit(struct buf *b, int write, int readahead)
 {
   uint64 sector = b->blockno * (BSIZE / 512);
 
-  acquire(&disk.vdisk_lock);
+  if(merge(b, write, readahead))
+    return 0;
 
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // data, one for a 1-byte status result. merge() may add more
+  // data descriptors later.
 
   // allocate the three descriptors.
   int idx[3];
@@ -229,6 +313,11 @@ virtio_disk_rw(struct buf *b, int write)
     if(alloc3_desc(idx) == 0) {
       break;
     }
+    if(readahead)
+      return -1;
+    // the requests holding descriptors have to be started
+    // for any to come free.
+    kick();
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
 
@@ -266,28 +355,92 @@ virtio_disk_rw(struct buf *b, int write)
 
   // record struct buf for virtio_disk_intr().
   b->disk = 1;
+  b->dnext = 0;
   disk.info[idx[0]].b = b;
+  disk.info[idx[0]].last = b;
+  disk.info[idx[0]].nbuf = 1;
+  disk.info[idx[0]].tail = idx[1];
+  disk.info[idx[0]].write = write;
+  disk.info[idx[0]].readahead = readahead;
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  disk.pending[disk.npending++] = idx[0];
+  disk.nreq++;
+  disk.nblock++;
 
-  __sync_synchronize();
+  return 0;
+}
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+// Read or write b, and wait until the disk is done.
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+  submit(b, write, 0);
+  kick();
 
-  __sync_synchronize();
+  // Wait for virtio_disk_intr() to say request has finished.
+  while(b->disk == 1) {
+    sleep(b, &disk.vdisk_lock);
+  }
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  release(&disk.vdisk_lock);
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
+// Queue a read or write of locked buffer b, to be started
+// with others by virtio_disk_kick() or virtio_disk_wait().
+// Then call virtio_disk_wait(b) before using b again.
+void
+virtio_disk_start(struct buf *b, int write)
+{
+  acquire(&disk.vdisk_lock);
+  submit(b, write, 0);
+  release(&disk.vdisk_lock);
+}
+
+// Start any queued requests, and wait for b's to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+}
+
+// Queue a read of locked buffer b that no one will wait for.
+// When it finishes, virtio_disk_intr() passes b to
+// breaddone(), which unlocks it. Returns -1, having done
+// nothing, if the queue is full.
+int
+virtio_disk_readahead(struct buf *b)
+{
+  int r;
+
+  acquire(&disk.vdisk_lock);
+  r = submit(b, 0, 1);
+  release(&disk.vdisk_lock);
+  return r;
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// Start the requests queued so far.
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  release(&disk.vdisk_lock);
+}
 
+// Report how many requests the device has been given since
+// boot, and how many blocks they covered between them.
+void
+virtio_disk_stat(uint64 *nreq, uint64 *nblock)
+{
+  acquire(&disk.vdisk_lock);
+  *nreq = disk.nreq;
+  *nblock = disk.nblock;
   release(&disk.vdisk_lock);
 }
 
@@ -316,9 +469,18 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    struct buf *b = disk.info[id].b, *next;
+    int readahead = disk.info[id].readahead;
+    disk.info[id].b = 0;
+    free_chain(id);
+    for(; b; b = next){
+      next = b->dnext;
+      b->disk = 0;   // disk is done with buf
+      if(readahead)
+        breaddone(b);
+      else
+        wakeup(b);
+    }
 
     disk.used_idx += 1;
   }
@@ -17,6 +17,9 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static int demote(pte_t*);
+static uint64 vmfault1(struct proc*, uint64, int);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -32,6 +35,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for ipi()
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -45,8 +51,7 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // allocate and map a kernel stack for each process.
-  proc_mapstacks(kpgtbl);
+  // allocproc() maps each process's kernel stack as it's created.
   
   return kpgtbl;
 }
@@ -84,6 +89,13 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A leaf PTE in a level-1 page maps a 2-megabyte superpage.
+// walk() splits a superpage it finds on the way into 512
+// ordinary pages (see demote), since its callers deal in
+// single pages; it returns 0 if that runs out of memory.
+// Code that wants to keep superpages intact looks at the
+// level-1 PTE first, with walksuper(), or uses walkpte().
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -92,18 +104,96 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
 
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) && PTE_LEAF(*pte) && demote(pte) != 0)
+      return 0;
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Return the address of the level-1 PTE for va, which is
+// either a superpage or points to va's leaf page-table page.
+// If alloc!=0, create the level-1 page-table page if needed.
+static pte_t *
+walksuper(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walksuper");
+
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
+// Split the superpage that the level-1 PTE *pte maps into
+// 512 pages, mapped by a new leaf page-table page with the
+// same permissions. Each page holds its own reference to
+// the superpage. Returns 0, or -1 if out of memory.
+static int
+demote(pte_t *pte)
+{
+  pagetable_t pt;
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++){
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+    if(i > 0)
+      kdup((void*)pa);
+  }
+  *pte = PA2PTE(pt) | PTE_V;
+  return 0;
+}
+
+// Return the leaf PTE that maps va, which is a level-1 PTE
+// if va lies in a superpage; don't split it, and don't
+// allocate. Sets *pa to the physical address of va's page.
+// Returns 0 if there's no leaf page-table page for va.
+static pte_t *
+walkpte(pagetable_t pagetable, uint64 va, uint64 *pa)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  if((pte = walksuper(pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    return 0;
+  if(PTE_LEAF(*pte)){
+    *pa = PTE2PA(*pte) + PGROUNDDOWN(va % SUPERPGSIZE);
+    return pte;
+  }
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(0, va)];
+  *pa = PTE2PA(*pte);
+  return pte;
+}
+
+// The number of pages from va to the end of the range
+// covered by va's leaf (level-0) page-table page. Functions
+// that handle a range of pages call walk() once per leaf
+// page and then step through its PTEs with pte++, instead
+// of walking down from the root for every page.
+static inline uint64
+leafspan(uint64 va)
+{
+  return 512 - PX(0, va);
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -116,25 +206,42 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walkpte(pagetable, va, &pa);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
   return pa;
 }
 
-// add a mapping to the kernel page table.
+// add a mapping to the kernel page table, using superpages
+// for any aligned 2-megabyte stretches.
 // only used when booting.
 // does not flush TLB or enable paging.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 end = va + sz, n;
+  pte_t *pte;
+
+  while(va < end){
+    if(va % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 && end - va >= SUPERPGSIZE){
+      if((pte = walksuper(kpgtbl, va, 1)) == 0 || (*pte & PTE_V))
+        panic("kvmmap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      n = SUPERPGSIZE;
+    } else {
+      n = SUPERPGROUNDDOWN(va) + SUPERPGSIZE - va;
+      if(n > end - va)
+        n = end - va;
+      if(mappages(kpgtbl, va, n, pa, perm) != 0)
+        panic("kvmmap");
+    }
+    va += n;
+    pa += n;
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -144,7 +251,7 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, n;
   pte_t *pte;
 
   if(size == 0)
@@ -155,45 +262,111 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   for(;;){
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
-    if(*pte & PTE_V)
-      panic("mappages: remap");
-    *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
-      break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    for(n = leafspan(a); n > 0; n--, pte++){
+      if(*pte & PTE_V)
+        panic("mappages: remap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      if(a == last)
+        return 0;
+      a += PGSIZE;
+      pa += PGSIZE;
+    }
   }
-  return 0;
+}
+
+// Split the superpage that va lies in, if there is one and
+// [start, end) doesn't cover it whole.
+// Returns 0, or -1 if out of memory.
+static int
+splitedge(pagetable_t pagetable, uint64 va, uint64 start, uint64 end)
+{
+  pte_t *pte = walksuper(pagetable, va, 0);
+  uint64 base = SUPERPGROUNDDOWN(va);
+
+  if(pte == 0 || (*pte & PTE_V) == 0 || !PTE_LEAF(*pte))
+    return 0;
+  if(base >= start && base + SUPERPGSIZE <= end)
+    return 0;
+  return demote(pte);
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
-void
+// page-aligned. Pages that were never mapped (lazily
+// allocated heap that was never touched) are skipped.
+// A superpage that is only partly in the range is split.
+// Optionally drop the reference to the physical memory,
+// which frees it once no other page table maps it.
+// Returns 0, or -1 if a superpage couldn't be split, in
+// which case nothing has been unmapped.
+int
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, n, end;
   pte_t *pte;
+  int cleared = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+  if(npages == 0)
+    return 0;
+  end = va + npages*PGSIZE;
+  // only the first and last superpage can stick out of the range.
+  if(splitedge(pagetable, va, va, end) != 0 ||
+     splitedge(pagetable, end - PGSIZE, va, end) != 0)
+    return -1;
+
+  // when freeing, only clear PTE_V for now: the pages are
+  // freed by the second loop, after a single TLB shootdown
+  // for the whole range, once no other thread can reach them.
+  end = va + npages*PGSIZE;
+  for(a = va; a < end; a += n*PGSIZE){
+    n = leafspan(a);
+    if(n > (end - a) / PGSIZE)
+      n = (end - a) / PGSIZE;
+    pte = walksuper(pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && PTE_LEAF(*pte)){
+      // a whole superpage; splitedge() split any others.
+      *pte = do_free ? (*pte & ~PTE_V) : 0;
+      cleared = 1;
+      continue;
+    }
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
-    if(PTE_FLAGS(*pte) == PTE_V)
-      panic("uvmunmap: not a leaf");
-    
-    // Only free physical memory if it's not a shared page
-    // modified for task 1
-    if(do_free && (*pte & PTE_S) == 0){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      continue; // no leaf page-table page, nothing mapped.
+    for(uint64 i = 0; i < n; i++, pte++){
+      if((*pte & PTE_V) == 0)
+        continue;
+      if(PTE_FLAGS(*pte) == PTE_V)
+        panic("uvmunmap: not a leaf");
+      *pte = do_free ? (*pte & ~PTE_V) : 0;
+      cleared = 1;
+    }
+  }
+  if(!do_free || !cleared)
+    return 0;
+
+  tlbshootdown(pagetable);
+  for(a = va; a < end; a += n*PGSIZE){
+    n = leafspan(a);
+    if(n > (end - a) / PGSIZE)
+      n = (end - a) / PGSIZE;
+    if((pte = walksuper(pagetable, a, 0)) == 0 || *pte == 0)
+      continue;
+    if((*pte & PTE_V) == 0){
+      // a whole superpage, cleared above.
+      kfree((void*)PTE2PA(*pte));
+      *pte = 0;
+      continue;
+    }
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(0, a)];
+    for(uint64 i = 0; i < n; i++, pte++){
+      if(*pte == 0 || (*pte & PTE_V))
+        continue;
+      kfree((void*)PTE2PA(*pte));
+      *pte = 0;
     }
-    *pte = 0;
   }
+  return 0;
 }
 
 // create an empty user page table.
@@ -202,10 +375,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -219,44 +391,57 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kzalloc();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
 
 // Allocate PTEs and physical memory to grow process from oldsz to
-// newsz, which need not be page aligned.  Returns new size or 0 on error.
+// newsz, which need not be page aligned. Aligned 2-megabyte
+// stretches get a superpage if one is free.
+// Returns new size or 0 on error.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 {
   char *mem;
-  uint64 a;
+  uint64 a, n;
+  pte_t *pte;
 
   if(newsz < oldsz)
     return oldsz;
 
   oldsz = PGROUNDUP(oldsz);
-  for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
-    if(mem == 0){
-      uvmdealloc(pagetable, a, oldsz);
-      return 0;
+  for(a = oldsz; a < newsz; ){
+    if(a % SUPERPGSIZE == 0 && newsz - a >= SUPERPGSIZE &&
+       (pte = walksuper(pagetable, a, 1)) != 0 && *pte == 0 &&
+       (mem = ksuperalloc()) != 0){
+      memset(mem, 0, SUPERPGSIZE);
+      *pte = PA2PTE(mem) | PTE_R | PTE_U | xperm | PTE_V;
+      a += SUPERPGSIZE;
+      continue;
     }
-    memset(mem, 0, PGSIZE);
-    if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
-      kfree(mem);
-      uvmdealloc(pagetable, a, oldsz);
-      return 0;
+    if((pte = walk(pagetable, a, 1)) == 0)
+      goto err;
+    for(n = leafspan(a); n > 0 && a < newsz; n--, pte++, a += PGSIZE){
+      if((mem = kzalloc()) == 0)
+        goto err;
+      if(*pte & PTE_V)
+        panic("uvmalloc: remap");
+      *pte = PA2PTE(mem) | PTE_R | PTE_U | xperm | PTE_V;
     }
   }
   return newsz;
+
+ err:
+  uvmdealloc(pagetable, a, oldsz);
+  return 0;
 }
 
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if
+// a superpage that newsz cuts through couldn't be split.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -265,14 +450,16 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    if(uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1) != 0)
+      return oldsz;
   }
 
   return newsz;
 }
 
 // Recursively free page-table pages.
-// All leaf mappings must already have been removed.
+// All leaf mappings, superpages included, must already
+// have been removed.
 void
 freewalk(pagetable_t pagetable)
 {
@@ -301,40 +488,219 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
+// Map the pages that old maps in [va, va+size) into new at
+// the same addresses, taking a reference on each frame.
+// If cow is set, writable private pages become copy-on-write
+// in both page tables. A superpage wholly in the range is
+// shared as a superpage. va must be page-aligned.
+// Returns 0 on success, -1 on failure (having undone its work).
+static int
+uvmshare(pagetable_t old, pagetable_t new, uint64 va, uint64 size, int cow)
+{
+  pte_t *pte, *npte;
+  uint64 a, n, pa, end = va + size;
+  uint flags;
+
+  for(a = va; a < end; ){
+    n = leafspan(a);
+    if(n > (end - a + PGSIZE - 1) / PGSIZE)
+      n = (end - a + PGSIZE - 1) / PGSIZE;
+    pte = walksuper(old, a, 0);
+    if(n == 512 && pte && (*pte & PTE_V) && PTE_LEAF(*pte)){
+      if((npte = walksuper(new, a, 1)) == 0)
+        goto err;
+      if(*npte & PTE_V)
+        panic("uvmshare: remap");
+      pa = PTE2PA(*pte);
+      flags = PTE_FLAGS(*pte);
+      if(cow && (flags & PTE_W) && (flags & PTE_S) == 0){
+        flags = (flags & ~PTE_W) | PTE_C;
+        *pte = PA2PTE(pa) | flags;
+      }
+      kdup((void*)pa);
+      *npte = PA2PTE(pa) | flags;
+      a += SUPERPGSIZE;
+      continue;
+    }
+    if((pte = walk(old, a, 0)) == 0){
+      a += n*PGSIZE; // not touched yet; the child faults it in.
+      continue;
+    }
+    if((npte = walk(new, a, 1)) == 0)
+      goto err;
+    for(; n > 0; n--, pte++, npte++, a += PGSIZE){
+      if((*pte & PTE_V) == 0)
+        continue;
+      pa = PTE2PA(*pte);
+      flags = PTE_FLAGS(*pte);
+      if(cow && (flags & PTE_W) && (flags & PTE_S) == 0){
+        // the parent's stale TLB entries are flushed
+        // when it returns to user space (see userret),
+        // and its other threads' by uvmcopy().
+        flags = (flags & ~PTE_W) | PTE_C;
+        *pte = PA2PTE(pa) | flags;
+      }
+      if(*npte & PTE_V)
+        panic("uvmshare: remap");
+      kdup((void*)pa);
+      *npte = PA2PTE(pa) | flags;
+    }
+  }
+  return 0;
+
+ err:
+  uvmunmap(new, va, (a - va) / PGSIZE, 1);
+  return -1;
+}
+
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table but not the physical
+// memory: the child maps the parent's pages,
+// and writable ones become copy-on-write in
+// both, so that the first store to a page
+// gives the writer its own copy (see uvmcow).
+// Shared pages stay writable in both.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
+  if(uvmshare(old, new, 0, sz, 1) != 0)
+    return -1;
+  tlbshootdown(old);
+  return 0;
+}
+
+// Handle a store to the copy-on-write page containing va:
+// give pagetable a private, writable copy of the page, or
+// just make it writable if no other page table maps it.
+// A copy-on-write superpage that no other page table maps
+// is made writable whole; otherwise it's split first, and
+// copied a page at a time.
+// Returns 0 on success, -1 if va isn't a copy-on-write
+// page or there's no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte, old;
+  uint64 pa;
   uint flags;
   char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walksuper(pagetable, va, 0)) != 0){
+    old = *pte;
+    if((old & PTE_V) && PTE_LEAF(old) && (old & PTE_C) &&
+       krefcnt((void*)PTE2PA(old)) == 1 &&
+       __sync_bool_compare_and_swap(pte, old, (old & ~PTE_C) | PTE_W))
+      return 0;
+  }
+  if((pte = walk(pagetable, PGROUNDDOWN(va), 0)) == 0)
+    return -1;
+
+  for(;;){
+    old = *pte;
+    if((old & PTE_V) == 0 || (old & PTE_U) == 0)
+      return -1;
+    if((old & PTE_C) == 0)
+      return (old & PTE_W) ? 0 : -1; // resolved by someone else?
+    pa = PTE2PA(old);
+    flags = (PTE_FLAGS(old) & ~PTE_C) | PTE_W;
+
+    // the PTE is swapped in with a compare-and-swap, since
+    // map_shared_pages() may be breaking the same page's
+    // copy-on-write from another process.
+    if(krefcnt((void*)pa) == 1){
+      if(__sync_bool_compare_and_swap(pte, old, PA2PTE(pa) | flags))
+        return 0;
+      continue;
+    }
     if((mem = kalloc()) == 0)
-      goto err;
+      return -1;
     memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
+    if(__sync_bool_compare_and_swap(pte, old, PA2PTE(mem) | flags)){
+      // other threads may still be reading the old page.
+      tlbshootdown(pagetable);
+      kfree((void*)pa);
+      return 0;
     }
+    kfree(mem);
   }
-  return 0;
+}
 
- err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
-  return -1;
+// Handle a page fault by process p at va. A load or store to
+// a heap page that sbrk() handed out but nobody has touched
+// yet maps a zeroed page, or a zeroed superpage if the
+// whole aligned 2 megabytes around va are untouched heap;
+// a store (write != 0) to a copy-on-write page copies it.
+// Returns the physical address of the page, or 0 if the
+// access is illegal or there is no memory.
+uint64
+vmfault(struct proc *p, uint64 va, int write)
+{
+  uint64 pa;
+
+  // the address space belongs to the first thread, and its
+  // lock keeps other threads from faulting in the same page.
+  p = p->leader;
+  acquire(&p->lock);
+  pa = vmfault1(p, va, write);
+  release(&p->lock);
+  return pa;
+}
+
+// vmfault() for a leader p whose lock the caller holds.
+static uint64
+vmfault1(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  uint64 pa, base;
+  char *mem;
+
+  if(va >= p->sz)
+    return 0;
+  va = PGROUNDDOWN(va);
+
+  if((pte = walkpte(p->pagetable, va, &pa)) != 0 && (*pte & PTE_V)){
+    // another thread may have faulted it in already.
+    if((*pte & PTE_U) && (write ? (*pte & PTE_W) : (*pte & PTE_R)))
+      return pa;
+    // already mapped, e.g. the stack guard page or text.
+    if(write && (*pte & PTE_C) && uvmcow(p->pagetable, va) == 0)
+      return walkaddr(p->pagetable, va);
+    return 0;
+  }
+
+  base = SUPERPGROUNDDOWN(va);
+  if(base + SUPERPGSIZE <= p->sz &&
+     (pte = walksuper(p->pagetable, base, 1)) != 0 && *pte == 0 &&
+     (mem = ksuperalloc()) != 0){
+    memset(mem, 0, SUPERPGSIZE);
+    *pte = PA2PTE(mem) | PTE_W|PTE_R|PTE_U|PTE_V;
+    return (uint64)mem + (va - base);
+  }
+
+  if((mem = kzalloc()) == 0)
+    return 0;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Fault in the page at va for copyin() and copyout(), if
+// pagetable belongs to the current process.
+static uint64
+copyfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return 0;
+  return vmfault(p, va, write);
 }
 
 // mark a PTE invalid for user access.
@@ -350,6 +716,51 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Look up user page va0 for copyin() or copyout(), faulting
+// it in first if need be (for write, taking our own copy of
+// a copy-on-write page), and take a reference to it, so that
+// another thread unmapping it can't free it while the kernel
+// copies. Return the physical address, or 0 if va0 isn't
+// mapped; the caller must kfree() the page when done.
+// If shared isn't 0, set *shared if the page is PTE_S.
+uint64
+walkref(pagetable_t pagetable, uint64 va0, int write, int *shared)
+{
+  struct proc *p = myproc();
+  struct spinlock *lk = 0;
+  pte_t *pte;
+  uint64 pa0;
+
+  if(va0 >= MAXVA)
+    return 0;
+  // the leader's lock keeps other threads from changing the
+  // mapping between the walk and kdup().
+  if(p && p->pagetable == pagetable)
+    lk = &p->leader->lock;
+  while(1){
+    if(lk)
+      acquire(lk);
+    pte = walkpte(pagetable, va0, &pa0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_C))){
+      pa0 = 0;
+    } else if((*pte & PTE_U) == 0){
+      if(lk)
+        release(lk);
+      return 0;
+    } else {
+      kdup((void*)pa0);
+      if(shared)
+        *shared = (*pte & PTE_S) != 0;
+    }
+    if(lk)
+      release(lk);
+    if(pa0)
+      return pa0;
+    if(copyfault(pagetable, va0, write) == 0)
+      return 0;
+  }
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -360,13 +771,13 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = walkref(pagetable, va0, 1, 0)) == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    kfree((void *)pa0);
 
     len -= n;
     src += n;
@@ -385,13 +796,13 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = walkref(pagetable, va0, 0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    kfree((void *)pa0);
 
     len -= n;
     dst += n;
@@ -412,8 +823,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pa0 = walkref(pagetable, va0, 0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
@@ -433,6 +843,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    kfree((void *)pa0);
 
     srcva = va0 + PGSIZE;
   }
@@ -443,14 +854,216 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   }
 }
 
-// Map shared pages from src_proc to dst_proc
+// The mmap area, between the top of the heap and MMAPTOP,
+// holds shared mappings and shared-memory segments. Each
+// process keeps a list of the regions it has mapped there
+// (p->vma), protected by p->lock.
+
+// Find the highest free range of size bytes in p's mmap
+// area, searching down from MMAPTOP for the first gap
+// that fits. A range of a superpage or more starts at an
+// address equal to color modulo SUPERPGSIZE, so that it
+// can map superpages from memory at such an address.
+// Returns its start address, or 0.
+static uint64
+mmapfind(struct proc *p, uint64 size, uint64 color)
+{
+  uint64 top = MMAPTOP, start;
+  struct vma *v;
+
+ again:
+  if(size > top)
+    return 0;
+  start = top - size;
+  if(size >= SUPERPGSIZE){
+    if(start < color)
+      return 0;
+    start = SUPERPGROUNDDOWN(start - color) + color;
+  }
+  if(start < PGROUNDUP(p->sz))
+    return 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start != 0 && v->start < start + size && v->end > start){
+      top = v->start;
+      goto again;
+    }
+  }
+  return start;
+}
+
+// Record a new region of size bytes in p's mmap area, at va
+// or, if va is 0, wherever there's room (see mmapfind for
+// color). A chosen va must be page-aligned and free.
+// Doesn't map any pages.
+// Returns the region, or 0.
+struct vma*
+vmacreate(struct proc *p, uint64 va, uint64 size, uint64 color, int shmid)
+{
+  struct vma *v, *free = 0;
+
+  if(size == 0 || size % PGSIZE != 0)
+    return 0;
+  if(va == 0){
+    va = mmapfind(p, size, color % SUPERPGSIZE);
+  } else if(va % PGSIZE != 0 || va < PGROUNDUP(p->sz) ||
+            va + size < va || va + size > MMAPTOP){
+    va = 0;
+  }
+  if(va == 0)
+    return 0;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start == 0){
+      if(free == 0)
+        free = v;
+    } else if(v->start < va + size && v->end > va){
+      return 0;
+    }
+  }
+  if(free){
+    free->start = va;
+    free->end = va + size;
+    free->shmid = shmid;
+  }
+  return free;
+}
+
+// Return the region of p's mmap area that contains va, or 0.
+struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start != 0 && v->start <= va && va < v->end)
+      return v;
+  }
+  return 0;
+}
+
+// Unmap [start, end) of region v, which must lie within it,
+// and shrink, split, or free the region to match. A
+// shared-memory segment can only be removed whole.
+// Returns 0 on success, -1 on failure.
+int
+vmaremove(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  struct vma *w = 0;
+
+  if(start < v->start || end > v->end || start >= end)
+    return -1;
+  if(v->shmid >= 0 && (start != v->start || end != v->end))
+    return -1;
+  if(start > v->start && end < v->end){
+    // a hole in the middle; the top part needs its own slot.
+    for(w = p->vma; w < &p->vma[NVMA] && w->start != 0; w++)
+      ;
+    if(w == &p->vma[NVMA])
+      return -1;
+  }
+
+  if(uvmunmap(p->pagetable, start, (end - start) / PGSIZE, 1) != 0)
+    return -1;
+
+  if(w){
+    w->start = end;
+    w->end = v->end;
+    w->shmid = -1;
+    v->end = start;
+  } else if(start == v->start && end == v->end){
+    if(v->shmid >= 0)
+      shmput(v->shmid);
+    v->start = v->end = 0;
+    v->shmid = -1;
+  } else if(start == v->start){
+    v->start = end;
+  } else {
+    v->end = start;
+  }
+  return 0;
+}
+
+// Unmap all of p's mmap area, on exit or exec.
+void
+vmafreeall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start != 0)
+      vmaremove(p, v, v->start, v->end);
+  }
+}
+
+// Give the child np of fork the same mmap regions as p,
+// mapping the same pages.
+// Returns 0 on success, -1 on failure.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+
+  for(int i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->start == 0)
+      continue;
+    np->vma[i] = *v;
+    if(v->shmid >= 0)
+      shmdup(v->shmid);
+    if(uvmshare(p->pagetable, np->pagetable, v->start, v->end - v->start, 0) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Where p's mmap area currently begins; the heap
+// can't grow past this.
+uint64
+vmalimit(struct proc *p)
+{
+  uint64 limit = MMAPTOP;
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->start != 0 && v->start < limit)
+      limit = v->start;
+  }
+  return limit;
+}
+
+// Map the superpage at va in src into dst at a, shared, if
+// src maps one there and dst has nothing mapped around a.
+// Returns 0, or -1 if the pages have to be mapped one at
+// a time.
+static int
+mapsuper(pagetable_t src, pagetable_t dst, uint64 va, uint64 a)
+{
+  pte_t *spte, *dpte;
+
+  spte = walksuper(src, va, 0);
+  if(spte == 0 || (*spte & PTE_V) == 0 || !PTE_LEAF(*spte) || (*spte & PTE_U) == 0)
+    return -1;
+  // uvmcow() keeps the superpage only if src is its sole owner.
+  if((*spte & PTE_C) && (uvmcow(src, va) != 0 || !PTE_LEAF(*spte)))
+    return -1;
+  if((dpte = walksuper(dst, a, 1)) == 0 || *dpte != 0)
+    return -1;
+  kdup((void*)PTE2PA(*spte));
+  *spte |= PTE_S;
+  *dpte = *spte;
+  return 0;
+}
+
+// Map shared pages from src_proc into dst_proc's mmap area.
+// The caller must hold both processes' locks.
 uint64
 map_shared_pages(struct proc* src_proc, struct proc* dst_proc, uint64 src_va, uint64 size)
 {
   uint64 start_va, end_va, dst_va, offset;
-  pte_t *pte;
-  uint64 pa, flags;
+  pte_t *spte = 0, *dpte = 0;
+  uint64 va, a, pa, flags;
   uint64 mapped_size;
+  struct vma *v;
   
   if(size == 0)
     return -1;
@@ -460,65 +1073,83 @@ map_shared_pages(struct proc* src_proc, struct proc* dst_proc, uint64 src_va, ui
   start_va = PGROUNDDOWN(src_va);
   end_va = PGROUNDUP(src_va + size);
   mapped_size = end_va - start_va;
+  if(end_va < start_va || end_va > MAXVA)
+    return -1;
   
-  // Find a free virtual address range in destination process
-  // Start looking from the current process size and find unmapped pages
-  dst_va = PGROUNDUP(dst_proc->sz);
-  
-  // Make sure we have enough virtual address space
-  if(dst_va + mapped_size >= MAXVA)
+  // Find a free virtual address range in the destination's
+  // mmap area, lined up with the source modulo the superpage
+  // size so that source superpages can be mapped whole.
+  if((v = vmacreate(dst_proc, 0, mapped_size, start_va, -1)) == 0)
     return -1;
+  dst_va = v->start;
   
-  // Check if the destination range is free
-  for(uint64 va = dst_va; va < dst_va + mapped_size; va += PGSIZE) {
-    pte = walk(dst_proc->pagetable, va, 0);
-    if(pte != 0 && (*pte & PTE_V)) {
-      // Address already mapped, this shouldn't happen if we start from sz
-      return -1;
+  // Map each page from source to destination. Source and
+  // destination page tables are walked only when va or a
+  // enters a new leaf page-table page; otherwise the next
+  // PTE is the next page's.
+  for(va = start_va, a = dst_va; va < end_va; va += PGSIZE, a += PGSIZE) {
+    if(va % SUPERPGSIZE == 0 && a % SUPERPGSIZE == 0 && end_va - va >= SUPERPGSIZE &&
+       mapsuper(src_proc->pagetable, dst_proc->pagetable, va, a) == 0){
+      va += SUPERPGSIZE - PGSIZE;
+      a += SUPERPGSIZE - PGSIZE;
+      continue;
     }
-  }
-  
-  // Map each page from source to destination
-  for(uint64 va = start_va; va < end_va; va += PGSIZE) {
-    // Get source PTE
-    pte = walk(src_proc->pagetable, va, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0) {
-      // Invalid or non-user page, unmap what we've done so far
-      if(va > start_va) {
-        uvmunmap(dst_proc->pagetable, dst_va, (va - start_va) / PGSIZE, 0);
-      }
-      return -1;
+    if(va == start_va || PX(0, va) == 0)
+      spte = walk(src_proc->pagetable, va, 0);
+    else
+      spte++;
+    if(a == dst_va || PX(0, a) == 0){
+      if((dpte = walk(dst_proc->pagetable, a, 1)) == 0)
+        goto bad;
+    } else {
+      dpte++;
     }
-    
-    // Get physical address and flags
-    pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte) | PTE_S; // Add shared flag
-    
-    // Map to destination
-    uint64 dst_page_va = dst_va + (va - start_va);
-    if(mappages(dst_proc->pagetable, dst_page_va, PGSIZE, pa, flags) != 0) {
-      // Failed to map, clean up
-      if(va > start_va) {
-        uvmunmap(dst_proc->pagetable, dst_va, (va - start_va) / PGSIZE, 0);
-      }
-      return -1;
+
+    // Fault in heap pages the source hasn't touched yet.
+    if(spte == 0 || (*spte & PTE_V) == 0){
+      if(vmfault1(src_proc, va, 0) == 0)
+        goto bad;
+      spte = walk(src_proc->pagetable, va, 0);
     }
+    if((*spte & PTE_U) == 0)
+      goto bad;
+
+    // A copy-on-write source page needs a frame of its own
+    // first, or the sharing would end at the source's next store.
+    if((*spte & PTE_C) && uvmcow(src_proc->pagetable, va) != 0)
+      goto bad;
+
+    // Get physical address and flags. The source's page is
+    // shared now too, so that a later fork() of the source
+    // doesn't make it copy-on-write and split it from dst.
+    *spte |= PTE_S;
+    pa = PTE2PA(*spte);
+    flags = PTE_FLAGS(*spte);
+    
+    // Map to destination, taking a reference so the frame
+    // outlives the source process.
+    if(*dpte & PTE_V)
+      panic("map_shared_pages: remap");
+    kdup((void*)pa);
+    *dpte = PA2PTE(pa) | flags;
   }
   
-  // Update destination process size
-  dst_proc->sz = dst_va + mapped_size;
-  
   // Return destination virtual address with correct offset
   return dst_va + offset;
+
+ bad:
+  // unmap whatever was mapped so far.
+  vmaremove(dst_proc, v, v->start, v->end);
+  return -1;
 }
 
-// Unmap shared pages from process
+// Unmap shared pages from process.
+// The caller must hold p->lock.
 uint64
 unmap_shared_pages(struct proc* p, uint64 addr, uint64 size)
 {
   uint64 start_va, end_va;
-  pte_t *pte;
-  uint64 mapped_size;
+  struct vma *v;
   
   if(size == 0)
     return 0;
@@ -526,24 +1157,12 @@ unmap_shared_pages(struct proc* p, uint64 addr, uint64 size)
   // Calculate page-aligned boundaries
   start_va = PGROUNDDOWN(addr);
   end_va = PGROUNDUP(addr + size);
-  mapped_size = end_va - start_va;
   
-  // Verify all pages are shared before unmapping
-  for(uint64 va = start_va; va < end_va; va += PGSIZE) {
-    pte = walk(p->pagetable, va, 0);
-    if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_S) == 0) {
-      return -1; // Not a valid shared mapping
-    }
-  }
-  
-  // Unmap the pages (don't free physical memory since it's shared)
-  uvmunmap(p->pagetable, start_va, mapped_size / PGSIZE, 0);
-  
-  // Update process size - if we're unmapping from the end of the address space
-  if(start_va + mapped_size == p->sz) {
-    p->sz = start_va;
-  }
-  // Note: If unmapping from middle, we don't shrink sz to avoid creating holes
-  
-  return 0;
+  // The range must lie within one shared mapping. Unmapping
+  // frees the address space for reuse by later mappings,
+  // wherever in the mmap area it is.
+  v = vmalookup(p, start_va);
+  if(v == 0 || v->shmid >= 0 || end_va > v->end)
+    return -1;
+  return vmaremove(p, v, start_va, end_va);
 }
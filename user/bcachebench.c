@@ -0,0 +1,84 @@
+// Measure buffer cache lookups with 1 to 8 processes reading
+// a file that fits in the cache, over and over, in the spirit
+// of stressfs. Every read is a cache hit, so the time goes to
+// finding blocks in the cache; with a scalable cache, the
+// number of reads per tick should grow with the number of CPUs.
+// Each round also reports the cache's hits and misses (bstat).
+// usage: bcachebench [reads per process]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/bstat.h"
+
+#define NBLOCK 2  // blocks in each file; 8 files must fit in the cache
+
+int
+main(int argc, char *argv[])
+{
+  static int nprocs[] = { 1, 2, 4, 8 };
+  static char data[BSIZE];
+  char path[] = "bcachebench0";
+  struct bstat st0, st;
+  int i, j, k, n, np, fd, t0, t;
+
+  n = 2000;
+  if(argc > 1)
+    n = atoi(argv[1]);
+
+  // a file for each process, so they only share the cache.
+  memset(data, 'a', sizeof(data));
+  for(i = 0; i < 8; i++){
+    path[11] = '0' + i;
+    if((fd = open(path, O_CREATE | O_RDWR)) < 0){
+      printf("bcachebench: cannot create %s\n", path);
+      exit(1);
+    }
+    for(j = 0; j < NBLOCK; j++)
+      write(fd, data, sizeof(data));
+    close(fd);
+  }
+
+  for(i = 0; i < sizeof(nprocs)/sizeof(nprocs[0]); i++){
+    np = nprocs[i];
+    bstat(&st0);
+    t0 = uptime();
+    for(j = 0; j < np; j++){
+      int pid = fork();
+      if(pid < 0){
+        printf("bcachebench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        path[11] = '0' + j;
+        for(k = 0; k < n; k += NBLOCK){
+          if((fd = open(path, O_RDONLY)) < 0)
+            exit(1);
+          while(read(fd, data, sizeof(data)) > 0)
+            ;
+          close(fd);
+        }
+        exit(0);
+      }
+    }
+    for(j = 0; j < np; j++)
+      wait(0);
+    t = uptime() - t0;
+    bstat(&st);
+    printf("bcachebench: %d processes: %d block reads in %d ticks", np, np*n, t);
+    if(t > 0)
+      printf(", %d reads/tick", np*n/t);
+    printf(", %l hits, %l misses\n", st.hits - st0.hits, st.misses - st0.misses);
+  }
+
+  for(i = 0; i < 8; i++){
+    path[11] = '0' + i;
+    unlink(path);
+  }
+  bstat(&st);
+  printf("bcachebench: %d buffers; since boot %l hits, %l misses, %l ghost hits\n",
+         st.nbuf, st.hits, st.misses, st.ghosthits);
+  exit(0);
+}
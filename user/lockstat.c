@@ -0,0 +1,58 @@
+// Report spinlock contention, most contended kinds of lock first.
+// usage: lockstat [command [args...]]
+// With a command, zero the counts, run the command, and report
+// the counts while it ran; otherwise report the counts since boot.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/lockstat.h"
+#include "user/user.h"
+
+#define NSTAT 64
+
+struct lockstat stats[NSTAT];
+
+int
+main(int argc, char *argv[])
+{
+  struct lockstat t;
+  int i, j, n, pid;
+
+  if(argc > 1){
+    for(i = 0; lockstat(i, &t, 1) == 0; i++)
+      ;
+    pid = fork();
+    if(pid < 0){
+      printf("lockstat: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv + 1);
+      printf("lockstat: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+
+  for(n = 0; n < NSTAT && lockstat(n, &stats[n], 0) == 0; n++)
+    ;
+
+  // insertion sort by number of spins.
+  for(i = 1; i < n; i++){
+    t = stats[i];
+    for(j = i; j > 0 && stats[j-1].nspin < t.nspin; j--)
+      stats[j] = stats[j-1];
+    stats[j] = t;
+  }
+
+  printf("lock             #locks   #acquire      #spin\n");
+  for(i = 0; i < n; i++){
+    if(stats[i].nacquire == 0)
+      continue;
+    printf("%s", stats[i].name);
+    for(j = strlen(stats[i].name); j < 16; j++)
+      printf(" ");
+    printf(" %d %l %l\n", stats[i].nlock, stats[i].nacquire, stats[i].nspin);
+  }
+  exit(0);
+}
@@ -1,29 +1,59 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
+#include "user/ring.h"
 
 #define NCHILD 10
-#define BUFFER_SIZE 4096
+#define BUFFER_SIZE (4*4096)
 #define MAX_MESSAGE_LEN 100
+#define MAX_ATTEMPTS 1000
+#define TICKS_PER_SECOND 10  // see the timer interval in kernel/start.c
 
-// Message header structure (must be 4-byte aligned)
-struct message_header {
-    uint16 length;     // Message length (without null terminator)
-    uint16 child_id;   // Child process index
+// Each child writes to its own region of the shared buffer, so
+// writers never contend with each other; the parent merges the
+// regions as it reads. A region starts on a cache line, and holds
+// a single-producer ring (see ring.c) plus the child's counts.
+struct region {
+    uint64 dropped;    // messages the child gave up on because its ring stayed full
+    uint64 done;       // set once the child has written all its messages
+    char pad[RINGLINE - 2*sizeof(uint64)];
+    struct ring ring;
 };
 
-// Atomic compare and swap operation
-static inline uint32
-atomic_compare_and_swap(volatile uint32 *ptr, uint32 expected, uint32 new_val)
-{
-    return __sync_val_compare_and_swap(ptr, expected, new_val);
-}
+#define REGION_SIZE ((BUFFER_SIZE / NCHILD) & ~(RINGLINE - 1))
+
+// With -s, all the children write to one ring spanning many pages,
+// which is recycled as the parent reads. Rather than give up on a
+// message when the ring is full, a child sleeps until the parent has
+// made room (backpressure), or with -d it counts the messages it
+// couldn't write and then logs a record saying how many it dropped.
+// The parent sleeps, too, while the ring is empty.
+#define SHARED_PAGES 16
+#define MAX_WORKERS 400
 
-// Align address to 4-byte boundary
-static inline uint64
-align_address(uint64 addr)
+struct shared_log {
+    // written by the children
+    uint data_seq;          // bumped when there is more for a waiting parent
+    uint parent_waiting;
+    uint ndone;             // children that have written everything
+    char pad0[RINGLINE - 3*sizeof(uint)];
+    // written by the parent
+    uint space_seq;         // bumped when the parent frees space for waiting children
+    uint children_waiting;
+    char pad1[RINGLINE - 2*sizeof(uint)];
+    struct ring ring;
+};
+
+// at the start of each record in the shared ring.
+struct record {
+    uint16 child_id;
+    uint16 dropped;         // non-zero: the child dropped this many messages
+};
+
+static inline struct region*
+region_at(uint64 shared_buffer, int child_id)
 {
-    return (addr + 3) & ~3;
+    return (struct region*)(shared_buffer + child_id * REGION_SIZE);
 }
 
 // Simple integer to string conversion
@@ -56,153 +86,320 @@ int_to_str(int num, char *str)
     }
 }
 
+// Format message manually: "Message X from child Y"
 void
-child_process(uint64 shared_buffer, int child_id, uint64 buffer_size)
+format_message(char *message, int msg_num, int child_id)
+{
+    char msg_num_str[10];
+    char child_id_str[10];
+    
+    strcpy(message, "Message ");
+    int_to_str(msg_num, msg_num_str);
+    strcpy(message + strlen(message), msg_num_str);
+    strcpy(message + strlen(message), " from child ");
+    int_to_str(child_id, child_id_str);
+    strcpy(message + strlen(message), child_id_str);
+}
+
+// Fork a child with the size bytes at buffer mapped into it.
+// The parent does the mapping and passes the address down a
+// pipe, so that it knows when the mapping failed and the child
+// will never write anything. Returns the child's pid in the
+// parent, setting *addr to 0 if the mapping failed (the child
+// then just exits), or -1 if fork failed. In the child, returns
+// 0 with *addr where the buffer is mapped.
+int
+fork_mapped(char *buffer, uint64 size, uint64 *addr)
 {
-    // Each child writes multiple messages - make at least one child exceed page size
-    int num_messages = (child_id == 0) ? 50 : 10; // Child 0 writes many messages
+    int fds[2];
+    
+    if(pipe(fds) < 0) {
+        return -1;
+    }
+    int pid = fork();
+    if(pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    
+    if(pid == 0) {
+        close(fds[1]);
+        if(read(fds[0], addr, sizeof(*addr)) != sizeof(*addr) || *addr == 0) {
+            exit(1);
+        }
+        close(fds[0]);
+        return 0;
+    }
+    
+    close(fds[0]);
+    *addr = map_shared_pages(getpid(), pid, buffer, size);
+    if(*addr == (uint64)-1) {
+        *addr = 0;
+    }
+    write(fds[1], addr, sizeof(*addr));
+    close(fds[1]);
+    return pid;
+}
+
+void
+child_process(uint64 shared_buffer, int child_id, int num_messages)
+{
+    struct region *region = region_at(shared_buffer, child_id);
     
     for(int msg_num = 0; msg_num < num_messages; msg_num++) {
         char message[MAX_MESSAGE_LEN];
-        char msg_num_str[10];
-        char child_id_str[10];
         
-        // Format message manually: "Message X from child Y"
-        strcpy(message, "Message ");
-        int_to_str(msg_num, msg_num_str);
-        strcpy(message + strlen(message), msg_num_str);
-        strcpy(message + strlen(message), " from child ");
-        int_to_str(child_id, child_id_str);
-        strcpy(message + strlen(message), child_id_str);
+        format_message(message, msg_num, child_id);
         
-        int msg_len = strlen(message);
-        
-        // Find a free slot in the buffer
-        uint64 current_addr = shared_buffer;
+        // Only the parent frees space in our region, so retry a
+        // while before giving up on the message.
         int attempts = 0;
+        while(ring_put(&region->ring, message, strlen(message)) < 0 && ++attempts < MAX_ATTEMPTS)
+            ;
+        if(attempts == MAX_ATTEMPTS) {
+            region->dropped++;
+        }
+    }
+    
+    __atomic_store_n(&region->done, 1, __ATOMIC_RELEASE);
+    exit(0);
+}
+
+static void
+print_message(void *arg, void *rec, uint len)
+{
+    int child_id = *(int*)arg;
+    char message[MAX_MESSAGE_LEN + 1];
+    
+    memcpy(message, rec, len);
+    message[len] = '\0';
+    printf("Parent: Read from child %d (len=%d): %s\n", child_id, len, message);
+}
+
+void
+parent_process(uint64 shared_buffer)
+{
+    int messages_read = 0;
+    int dropped = 0;
+    int start = uptime();
+    
+    // Take turns reading a batch from each child's region until
+    // every child is done and its region is empty.
+    for(;;) {
+        int all_done = 1;
         
-        while(current_addr + sizeof(struct message_header) + msg_len < shared_buffer + buffer_size && attempts < 1000) {
-            // Check if we're properly aligned
-            current_addr = align_address(current_addr);
+        for(int i = 0; i < NCHILD; i++) {
+            struct region *region = region_at(shared_buffer, i);
+            // Read done before draining, so nothing written
+            // before it was set can be missed.
+            int done = __atomic_load_n(&region->done, __ATOMIC_ACQUIRE);
+            int n = ring_consume(&region->ring, print_message, &i, 16);
             
-            // Check bounds again after alignment
-            if(current_addr + sizeof(struct message_header) + msg_len >= shared_buffer + buffer_size) {
-                break;
-            }
-            
-            volatile uint32 *header_ptr = (volatile uint32*)current_addr;
-            uint32 expected = 0; // Free slot
-            
-            // Create new header
-            struct message_header new_header;
-            new_header.length = msg_len;
-            new_header.child_id = child_id;
-            uint32 new_header_val = *(uint32*)&new_header;
-            
-            // Try to claim this slot atomically
-            uint32 old_val = atomic_compare_and_swap(header_ptr, expected, new_header_val);
-            
-            if(old_val == 0) {
-                // Successfully claimed the slot, write the message
-                char *msg_ptr = (char*)(current_addr + sizeof(struct message_header));
-                memcpy(msg_ptr, message, msg_len);
-                break;
-            } else {
-                // Slot was taken, skip to next potential location
-                struct message_header *existing_header = (struct message_header*)&old_val;
-                current_addr += sizeof(struct message_header) + existing_header->length;
-                current_addr = align_address(current_addr);
-                attempts++;
+            messages_read += n;
+            if(!done || n > 0) {
+                all_done = 0;
             }
         }
         
-        if(attempts >= 1000) {
-            break; // Buffer full or too contentious
+        if(all_done) {
+            break;
         }
-        
-        // Brief yield to allow other processes to work
-        // sleep(1); // removed for final submission
     }
     
-    exit(0);
+    int ticks = uptime() - start;
+    
+    for(int i = 0; i < NCHILD; i++) {
+        dropped += region_at(shared_buffer, i)->dropped;
+    }
+    
+    printf("Parent: Read %d messages total, %d dropped\n", messages_read, dropped);
+    printf("Parent: %d ticks", ticks);
+    if(ticks > 0) {
+        printf(", %d messages/second", messages_read * TICKS_PER_SECOND / ticks);
+    }
+    printf("\n");
+    
+    // Wait for all children to finish
+    for(int i = 0; i < NCHILD; i++) {
+        wait(0);
+    }
+    
+    printf("Parent: All children finished\n");
+}
+
+// Wake the parent if it's waiting for data.
+static void
+wake_parent(struct shared_log *log)
+{
+    if(__atomic_load_n(&log->parent_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&log->data_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&log->data_seq, 1);
+    }
+}
+
+// Publish n records, sleeping while the ring is full.
+static void
+put_wait(struct shared_log *log, struct ringvec *v, int n)
+{
+    while(ring_putv(&log->ring, v, n) < 0) {
+        // Announce the wait before looking again, so that a parent
+        // that frees space after the second look sees it.
+        __atomic_fetch_add(&log->children_waiting, 1, __ATOMIC_SEQ_CST);
+        uint seq = __atomic_load_n(&log->space_seq, __ATOMIC_SEQ_CST);
+        if(ring_putv(&log->ring, v, n) == 0) {
+            __atomic_fetch_sub(&log->children_waiting, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        futex_wait(&log->space_seq, seq);
+        __atomic_fetch_sub(&log->children_waiting, 1, __ATOMIC_SEQ_CST);
+    }
+    wake_parent(log);
 }
 
 void
-parent_process(uint64 shared_buffer, uint64 buffer_size)
+shared_child_process(struct shared_log *log, int child_id, int num_messages, int drop)
 {
-    int messages_read = 0;
-    int consecutive_empty_scans = 0;
+    struct record rec = { child_id, 0 };
+    struct record drec = { child_id, 0 };
+    struct ringvec v[3];
+    struct ringvec dv = { &drec, sizeof(drec) };
+    int dropped = 0;
     
-    // Continuously scan for new messages while children are running
-    while(consecutive_empty_scans < 30) { // Increased threshold
-        uint64 read_addr = shared_buffer;
-        int found_new_message = 0;
+    for(int msg_num = 0; msg_num < num_messages; msg_num++) {
+        char message[MAX_MESSAGE_LEN];
+        int n = 0;
         
-        // Scan entire buffer each time to catch all messages
-        while(read_addr + sizeof(struct message_header) < shared_buffer + buffer_size) {
-            read_addr = align_address(read_addr);
-            
-            // Check bounds after alignment
-            if(read_addr + sizeof(struct message_header) >= shared_buffer + buffer_size) {
-                break;
-            }
-            
-            volatile uint32 *header_ptr = (volatile uint32*)read_addr;
-            uint32 header_val = *header_ptr;
-            
-            if(header_val == 0) {
-                // Free slot, move to next potential location
-                read_addr += sizeof(struct message_header);
-                continue;
-            }
-            
-            struct message_header *header = (struct message_header*)&header_val;
-            
-            // Validate header values
-            if(header->length == 0 || header->length > MAX_MESSAGE_LEN || 
-               header->child_id >= NCHILD) {
-                // Invalid header, skip
-                read_addr += sizeof(struct message_header);
-                continue;
-            }
-            
-            // Check if we have enough space for the message
-            if(read_addr + sizeof(struct message_header) + header->length >= shared_buffer + buffer_size) {
-                break;
-            }
-            
-            // Read the message
-            char *msg_ptr = (char*)(read_addr + sizeof(struct message_header));
-            char message[MAX_MESSAGE_LEN + 1];
-            memcpy(message, msg_ptr, header->length);
-            message[header->length] = '\0';
-            
-            printf("Parent: Read from child %d (len=%d): %s\n", header->child_id, header->length, message);
-            messages_read++;
-            found_new_message = 1;
-            
-            // Clear the header to mark as read - THIS PREVENTS RE-READING
-            *header_ptr = 0;
-            
-            // Move to next message
-            read_addr += sizeof(struct message_header) + header->length;
+        format_message(message, msg_num, child_id);
+        
+        // Say how many messages were lost before this one, in the
+        // same batch, so the count can't be lost too.
+        if(dropped > 0) {
+            drec.dropped = dropped;
+            v[n].buf = &drec;
+            v[n++].len = sizeof(drec);
         }
+        v[n].buf = &rec;
+        v[n++].len = sizeof(rec);
+        v[n].buf = message;
+        v[n++].len = strlen(message);
         
-        // Update scan counter
-        if(found_new_message) {
-            consecutive_empty_scans = 0;
+        if(!drop) {
+            put_wait(log, v, n);
+        } else if(ring_putv(&log->ring, v, n) == 0) {
+            dropped = 0;
+            wake_parent(log);
+        } else if(++dropped == 0xffff) {
+            // the most a record can count
+            drec.dropped = dropped;
+            put_wait(log, &dv, 1);
+            dropped = 0;
+        }
+    }
+    
+    if(dropped > 0) {
+        drec.dropped = dropped;
+        put_wait(log, &dv, 1);
+    }
+    
+    __atomic_fetch_add(&log->ndone, 1, __ATOMIC_SEQ_CST);
+    wake_parent(log);
+    exit(0);
+}
+
+// Counts per child, printed once the timing is over: printing
+// each message as it arrives would time the console instead.
+struct shared_stats {
+    int messages_read;
+    int dropped;
+    int child_id;           // of the record being read, or -1
+    int nread[MAX_WORKERS];
+    int ndropped[MAX_WORKERS];
+};
+
+// A message comes as two records, published together: a struct
+// record, then the text. A struct record may also stand alone,
+// counting dropped messages.
+static void
+count_shared_record(void *arg, void *data, uint len)
+{
+    struct shared_stats *stats = arg;
+    struct record *rec = data;
+    
+    if(stats->child_id < 0) {
+        if(rec->dropped > 0) {
+            stats->ndropped[rec->child_id] += rec->dropped;
+            stats->dropped += rec->dropped;
         } else {
-            consecutive_empty_scans++;
+            stats->child_id = rec->child_id;
+        }
+        return;
+    }
+    
+    stats->nread[stats->child_id]++;
+    stats->messages_read++;
+    stats->child_id = -1;
+}
+
+// Read a batch of records, and wake any children waiting for the
+// space they took. Returns the number of records.
+static int
+consume(struct shared_log *log, struct shared_stats *stats)
+{
+    int n = ring_consume(&log->ring, count_shared_record, stats, 64);
+    
+    if(n > 0 && __atomic_load_n(&log->children_waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&log->space_seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&log->space_seq, MAX_WORKERS);
+    }
+    return n;
+}
+
+void
+shared_parent_process(struct shared_log *log, int nchild)
+{
+    static struct shared_stats stats;
+    int start = uptime();
+    
+    stats.child_id = -1;
+    
+    for(;;) {
+        if(consume(log, &stats) > 0) {
+            continue;
         }
         
-        // Brief sleep to avoid busy waiting
-        // sleep(1); // removed for final submission
+        // Nothing to read: stop if every child is done, or else
+        // sleep until a child writes more. Like the children, look
+        // again after announcing the wait.
+        int done = __atomic_load_n(&log->ndone, __ATOMIC_SEQ_CST) == nchild;
+        __atomic_store_n(&log->parent_waiting, 1, __ATOMIC_SEQ_CST);
+        uint seq = __atomic_load_n(&log->data_seq, __ATOMIC_SEQ_CST);
+        if(consume(log, &stats) == 0) {
+            if(done) {
+                break;
+            }
+            futex_wait(&log->data_seq, seq);
+        }
+        __atomic_store_n(&log->parent_waiting, 0, __ATOMIC_SEQ_CST);
     }
     
-    printf("Parent: Read %d messages total\n", messages_read);
+    int ticks = uptime() - start;
     
-    // Wait for all children to finish
-    for(int i = 0; i < NCHILD; i++) {
+    for(int i = 0; i < nchild; i++) {
+        printf("Parent: Read %d messages from child %d", stats.nread[i], i);
+        if(stats.ndropped[i] > 0) {
+            printf(", %d dropped", stats.ndropped[i]);
+        }
+        printf("\n");
+    }
+    printf("Parent: Read %d messages total, %d dropped\n", stats.messages_read, stats.dropped);
+    printf("Parent: %d ticks", ticks);
+    if(ticks > 0) {
+        printf(", %d messages/second", stats.messages_read * TICKS_PER_SECOND / ticks);
+    }
+    printf("\n");
+    
+    for(int i = 0; i < nchild; i++) {
         wait(0);
     }
     
@@ -210,8 +407,86 @@ parent_process(uint64 shared_buffer, uint64 buffer_size)
 }
 
 int
-main(void)
+shared_main(int argc, char *argv[])
 {
+    int drop = 0;
+    int nchild = NCHILD;
+    int num_messages = 10;
+    int pages = SHARED_PAGES;
+    
+    if(argc > 0 && strcmp(argv[0], "-d") == 0) {
+        drop = 1;
+        argc--;
+        argv++;
+    }
+    if(argc > 0) {
+        nchild = atoi(argv[0]);
+    }
+    if(argc > 1) {
+        num_messages = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        pages = atoi(argv[2]);
+    }
+    if(nchild < 1 || nchild > MAX_WORKERS || pages < 1) {
+        printf("log_test: bad arguments\n");
+        exit(1);
+    }
+    
+    printf("=== Multi-Process Logging Test, shared ring (%s) ===\n", drop ? "dropping" : "blocking");
+    
+    uint64 size = pages * 4096;
+    char *shared_buffer = sbrk(size);
+    if(shared_buffer == (char*)-1) {
+        printf("Failed to allocate shared buffer\n");
+        exit(1);
+    }
+    
+    struct shared_log *log = (struct shared_log*)shared_buffer;
+    memset(log, 0, sizeof(*log));
+    ring_init(&log->ring, size - ((char*)&log->ring - (char*)log));
+    
+    printf("Parent: Allocated shared buffer at %p (%d pages) for %d children\n", shared_buffer, pages, nchild);
+    
+    for(int i = 0; i < nchild; i++) {
+        uint64 mapped_addr;
+        int pid = fork_mapped(shared_buffer, size, &mapped_addr);
+        if(pid < 0) {
+            printf("Fork failed for child %d\n", i);
+            exit(1);
+        }
+        
+        if(pid > 0 && mapped_addr == 0) {
+            // Count the child as done, since it will never write.
+            printf("Child %d: Failed to map shared buffer\n", i);
+            __atomic_fetch_add(&log->ndone, 1, __ATOMIC_SEQ_CST);
+        }
+        
+        if(pid == 0) {
+            shared_child_process((struct shared_log*)mapped_addr, i, num_messages, drop);
+        }
+    }
+    
+    shared_parent_process(log, nchild);
+    exit(0);
+}
+
+// log_test [messages]
+// log_test -s [-d] [children [messages [pages]]]
+int
+main(int argc, char *argv[])
+{
+    if(argc > 1 && strcmp(argv[1], "-s") == 0) {
+        shared_main(argc - 2, argv + 2);
+    }
+    
+    // Each child writes num_messages, or by default child 0 writes
+    // many more than fit in its region at once.
+    int num_messages = 0;
+    if(argc > 1) {
+        num_messages = atoi(argv[1]);
+    }
+    
     printf("=== Multi-Process Logging Test ===\n");
     
     // Allocate shared buffer in parent
@@ -221,37 +496,45 @@ main(void)
         exit(1);
     }
     
-    // Initialize buffer to zero
-    memset(shared_buffer, 0, BUFFER_SIZE);
+    // Give each child an empty region. sbrk() hands out memory from
+    // a page boundary here, so the regions are cache-line aligned.
+    for(int i = 0; i < NCHILD; i++) {
+        struct region *region = region_at((uint64)shared_buffer, i);
+        memset(region, 0, sizeof(*region));
+        ring_init(&region->ring, REGION_SIZE - ((char*)&region->ring - (char*)region));
+    }
     
-    printf("Parent: Allocated shared buffer at %p (size %d)\n", shared_buffer, BUFFER_SIZE);
+    printf("Parent: Allocated shared buffer at %p (size %d, %d per child)\n", shared_buffer, BUFFER_SIZE, REGION_SIZE);
     
     // Fork child processes
     for(int i = 0; i < NCHILD; i++) {
-        int pid = fork();
+        uint64 mapped_addr;
+        int pid = fork_mapped(shared_buffer, BUFFER_SIZE, &mapped_addr);
         if(pid < 0) {
             printf("Fork failed for child %d\n", i);
             exit(1);
         }
         
+        if(pid > 0 && mapped_addr == 0) {
+            // The child can't write, so don't wait for it to.
+            printf("Child %d: Failed to map shared buffer\n", i);
+            region_at((uint64)shared_buffer, i)->done = 1;
+        }
+        
         if(pid == 0) {
-            // Child process
-            // Map shared buffer from parent
-            uint64 mapped_addr = map_shared_pages(getppid(), getpid(), shared_buffer, BUFFER_SIZE);
-            if(mapped_addr == -1) {
-                printf("Child %d: Failed to map shared buffer\n", i);
-                exit(1);
+            // Child process: start logging immediately
+            if(num_messages > 0) {
+                child_process(mapped_addr, i, num_messages);
+            } else {
+                child_process(mapped_addr, i, i == 0 ? 50 : 10);
             }
-            
-            // Start logging immediately
-            child_process(mapped_addr, i, BUFFER_SIZE);
             // child_process calls exit(0)
         }
     }
     
     // Parent starts reading immediately - NO WAIT/SYNC
     // This achieves true concurrency as required
-    parent_process((uint64)shared_buffer, BUFFER_SIZE);
+    parent_process((uint64)shared_buffer);
     
     exit(0);
-}
\ No newline at end of file
+}
@@ -0,0 +1,51 @@
+// Time map_shared_pages()/unmap_shared_pages() of a large region.
+// usage: mapbench [iterations]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define PGSIZE 4096
+#define SIZE (4*1024*1024)
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, pid, t0, t1;
+  char *src, *dst;
+
+  n = 1000;
+  if(argc > 1)
+    n = atoi(argv[1]);
+
+  src = sbrk(SIZE);
+  if(src == (char*)-1){
+    printf("mapbench: sbrk failed\n");
+    exit(1);
+  }
+  // touch every page, so the timing doesn't include faulting them in.
+  for(i = 0; i < SIZE; i += PGSIZE)
+    src[i] = i / PGSIZE;
+
+  pid = getpid();
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    dst = (char*)map_shared_pages(pid, pid, src, SIZE);
+    if(dst == (char*)-1){
+      printf("mapbench: map_shared_pages failed\n");
+      exit(1);
+    }
+    if(dst[SIZE - PGSIZE] != src[SIZE - PGSIZE]){
+      printf("mapbench: bad mapping\n");
+      exit(1);
+    }
+    if(unmap_shared_pages(dst, SIZE) != 0){
+      printf("mapbench: unmap_shared_pages failed\n");
+      exit(1);
+    }
+  }
+  t1 = uptime();
+
+  printf("mapbench: %d map+unmap of %d KiB in %d ticks\n", n, SIZE/1024, t1 - t0);
+  exit(0);
+}
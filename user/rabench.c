@@ -0,0 +1,106 @@
+// Measure sequential read-ahead: read a 200-block file from
+// a cold buffer cache, with read-ahead off and then on, and
+// report the time each pass took, how many blocks had to
+// be read on demand (misses) or were read ahead, and how many
+// blocks the disk driver fit into each request on average.
+// Writing the file is measured the same way.
+// usage: rabench [blocks to read ahead]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "kernel/bstat.h"
+
+#define NBLOCK 200
+#define NPASS  3
+
+static char data[BSIZE];
+
+// print the disk requests made between st0 and st.
+static void
+diskreqs(struct bstat *st0, struct bstat *st)
+{
+  uint64 nreq = st->diskreqs - st0->diskreqs;
+  uint64 nblock = st->diskblocks - st0->diskblocks;
+
+  printf("%l disk requests for %l blocks", nreq, nblock);
+  if(nreq > 0)
+    printf(", %l.%l blocks/request", nblock / nreq, (nblock * 10 / nreq) % 10);
+}
+
+// read the whole file once, starting with nothing cached.
+static void
+pass(char *mode)
+{
+  struct bstat st0, st;
+  int fd, n, t0, t;
+
+  dropcache();
+  bstat(&st0);
+  t0 = uptime();
+  if((fd = open("rabench.data", O_RDONLY)) < 0){
+    printf("rabench: cannot open rabench.data\n");
+    exit(1);
+  }
+  n = 0;
+  while(read(fd, data, sizeof(data)) == sizeof(data))
+    n++;
+  close(fd);
+  t = uptime() - t0;
+  bstat(&st);
+  if(n != NBLOCK){
+    printf("rabench: read %d blocks, not %d\n", n, NBLOCK);
+    exit(1);
+  }
+
+  printf("rabench: read-ahead %s: %d blocks in %d ticks", mode, n, t);
+  if(t > 0)
+    printf(", %d blocks/tick", n/t);
+  printf(", %l misses, %l read ahead, ",
+         st.misses - st0.misses, st.readaheads - st0.readaheads);
+  diskreqs(&st0, &st);
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct bstat st0, st;
+  int i, fd, old, window;
+
+  old = setreadahead(-1);
+  window = old > 0 ? old : 8;
+  if(argc > 1)
+    window = atoi(argv[1]);
+
+  bstat(&st0);
+  if((fd = open("rabench.data", O_CREATE | O_RDWR)) < 0){
+    printf("rabench: cannot create rabench.data\n");
+    exit(1);
+  }
+  for(i = 0; i < NBLOCK; i++){
+    memset(data, 'a' + i % 26, sizeof(data));
+    if(write(fd, data, sizeof(data)) != sizeof(data)){
+      printf("rabench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+  bstat(&st);
+  printf("rabench: wrote %d blocks: ", NBLOCK);
+  diskreqs(&st0, &st);
+  printf("\n");
+
+  setreadahead(0);
+  for(i = 0; i < NPASS; i++)
+    pass("off");
+  setreadahead(window);
+  for(i = 0; i < NPASS; i++)
+    pass("on ");
+
+  setreadahead(old);
+  unlink("rabench.data");
+  exit(0);
+}
@@ -0,0 +1,170 @@
+// Lock-free ring buffer of variable-length records.
+//
+// Each record is an 8-byte header followed by its bytes,
+// padded to a multiple of 8, and lies in one piece in
+// data[]; a record that would run past the end is put at
+// the start instead, after a padding record that fills the
+// rest. A producer reserves space for a batch of records by
+// advancing head with a compare-and-swap, copies them in,
+// and then publishes each by storing its header, which is
+// zero until then. The consumer reads records in order up
+// to the first unpublished one, zeroes the space they took,
+// and then advances tail once for the whole batch. head and
+// tail are on separate cache lines, so producers and the
+// consumer only share a line when the ring is full or empty.
+
+#include "kernel/types.h"
+#include "user/user.h"
+#include "user/ring.h"
+
+#define READY 1UL  // header flags
+#define PAD   2UL
+
+#define RECSIZE(len) (8 + (((uint64)(len) + 7) & ~7UL))
+
+// Make a ring in bytes of memory at mem, which must be
+// 8-byte aligned. Returns the ring, or 0 if bytes is too small.
+struct ring *
+ring_init(void *mem, uint64 bytes)
+{
+  struct ring *r = mem;
+
+  if(bytes < sizeof(struct ring) + 64)
+    return 0;
+  memset(r, 0, bytes);
+  r->size = (bytes - sizeof(struct ring)) & ~7UL;
+  return r;
+}
+
+// Map the ring of the given size at r in process pid into
+// this process. Returns where it was mapped, or 0.
+struct ring *
+ring_attach(int pid, struct ring *r, uint64 bytes)
+{
+  uint64 va;
+
+  if((va = map_shared_pages(pid, getpid(), r, bytes)) == (uint64)-1)
+    return 0;
+  return (struct ring*)va;
+}
+
+static inline uint64*
+hdr(struct ring *r, uint64 off)
+{
+  return (uint64*)(r->data + off);
+}
+
+// Publish n records, in order, with a single reservation.
+// Returns 0, or -1 if there isn't room for all of them. A
+// batch that takes more than half the ring is always refused:
+// it could need to wrap even when the ring is empty, and
+// then never fit.
+int
+ring_putv(struct ring *r, struct ringvec *v, int n)
+{
+  uint64 h, off, need, total = 0;
+  int i;
+
+  for(i = 0; i < n; i++)
+    total += RECSIZE(v[i].len);
+  if(total == 0 || total > r->size / 2)
+    return -1;
+
+  do {
+    h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    off = h % r->size;
+    need = total;
+    if(off + total > r->size)
+      need += r->size - off;  // wrap, leaving padding
+    if(h + need - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->size)
+      return -1;
+  } while(!__atomic_compare_exchange_n(&r->head, &h, h + need, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if(need != total){
+    __atomic_store_n(hdr(r, off), ((r->size - off - 8) << 32) | PAD | READY,
+                     __ATOMIC_RELEASE);
+    off = 0;
+  }
+  for(i = 0; i < n; i++){
+    memmove(r->data + off + 8, v[i].buf, v[i].len);
+    __atomic_store_n(hdr(r, off), ((uint64)v[i].len << 32) | READY,
+                     __ATOMIC_RELEASE);
+    off += RECSIZE(v[i].len);
+  }
+  return 0;
+}
+
+// Publish one record. Returns 0, or -1 if the ring is full.
+int
+ring_put(struct ring *r, void *buf, uint len)
+{
+  struct ringvec v = { buf, len };
+
+  return ring_putv(r, &v, 1);
+}
+
+// Call fn(arg, rec, len) on each of up to max published
+// records, oldest first, then free their space. Only one
+// thread may consume at a time. Returns the number of records.
+int
+ring_consume(struct ring *r, void (*fn)(void*, void*, uint), void *arg, int max)
+{
+  uint64 t, end, h, off, len;
+  int n = 0;
+
+  // a full ring has head - tail == size; stop there, since
+  // the headers past it are the ones at tail again.
+  t = end = r->tail;
+  while(n < max && end - t < r->size){
+    off = end % r->size;
+    h = __atomic_load_n(hdr(r, off), __ATOMIC_ACQUIRE);
+    if((h & READY) == 0)
+      break;
+    len = h >> 32;
+    if((h & PAD) == 0){
+      fn(arg, r->data + off + 8, len);
+      n++;
+    }
+    end += RECSIZE(len);
+  }
+  if(end == t)
+    return 0;
+
+  // producers rely on free space being zeroed.
+  off = t % r->size;
+  if(off + (end - t) > r->size){
+    memset(r->data + off, 0, r->size - off);
+    memset(r->data, 0, end % r->size);
+  } else {
+    memset(r->data + off, 0, end - t);
+  }
+  __atomic_store_n(&r->tail, end, __ATOMIC_RELEASE);
+  return n;
+}
+
+struct getbuf {
+  void *buf;
+  uint max;
+  int len;
+};
+
+static void
+getone(void *arg, void *rec, uint len)
+{
+  struct getbuf *g = arg;
+
+  g->len = len;
+  memmove(g->buf, rec, len < g->max ? len : g->max);
+}
+
+// Take the oldest record, copying up to max bytes of it to
+// buf. Returns its length, or -1 if the ring is empty.
+int
+ring_get(struct ring *r, void *buf, uint max)
+{
+  struct getbuf g = { buf, max, -1 };
+
+  ring_consume(r, getone, &g, 1);
+  return g.len;
+}
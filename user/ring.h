@@ -0,0 +1,36 @@
+// A lock-free ring buffer of variable-length records, for
+// producers and a consumer that share its memory: threads,
+// or processes that map it with map_shared_pages(). Any
+// number of producers may publish at once (MPSC), but only
+// one thread may consume. See ring.c.
+
+#define RINGLINE 64  // cache line size
+
+struct ring {
+  // set by ring_init(), then only read.
+  uint64 size;             // bytes of data[]
+  char pad0[RINGLINE - 8];
+  // where producers reserve space next; only ever grows.
+  uint64 head;
+  char pad1[RINGLINE - 8];
+  // where the consumer reads next; all of data[] before
+  // it, back to head - size, is free and zeroed.
+  uint64 tail;
+  char pad2[RINGLINE - 8];
+  char data[];
+};
+
+// one record for ring_putv(). A batch of records, each
+// taking 8 bytes plus its length rounded up to 8, must fit
+// in half the ring.
+struct ringvec {
+  void *buf;
+  uint len;
+};
+
+struct ring *ring_init(void *mem, uint64 bytes);
+struct ring *ring_attach(int pid, struct ring *r, uint64 bytes);
+int ring_putv(struct ring *r, struct ringvec *v, int n);
+int ring_put(struct ring *r, void *buf, uint len);
+int ring_consume(struct ring *r, void (*fn)(void *arg, void *rec, uint len), void *arg, int max);
+int ring_get(struct ring *r, void *buf, uint max);
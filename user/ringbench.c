@@ -0,0 +1,124 @@
+// Measure ring buffer throughput with 1 to 16 producer
+// processes, each with the ring mapped by map_shared_pages(),
+// and one consumer.
+// usage: ringbench [records per producer]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+#include "user/ring.h"
+
+#define RINGBYTES (64*1024)
+#define BATCH 64
+
+struct stats {
+  int n;
+  int bad;
+};
+
+// records are "<producer><seq>", and 16 to 64 bytes long.
+static void
+check(void *arg, void *rec, uint len)
+{
+  struct stats *s = arg;
+  uchar *b = rec;
+
+  if(len < 16 || len > 64 || b[len-1] != b[0])
+    s->bad++;
+  s->n++;
+}
+
+static void
+produce(struct ring *r, int id, int n)
+{
+  uchar buf[64];
+  uint len;
+
+  for(int i = 0; i < n; i++){
+    len = 16 + (i % 49);
+    memset(buf, id, len);
+    while(ring_put(r, buf, len) < 0)
+      ;
+  }
+}
+
+// Fork a producer of n records into r. The parent maps the
+// ring into the child and passes the address down a pipe, so
+// that it knows whether the child will produce anything.
+// Returns 1 if it will, 0 if the ring couldn't be mapped
+// (the child just exits), or -1 if fork failed.
+static int
+forkproducer(struct ring *r, int id, int n)
+{
+  int fds[2], pid;
+  uint64 va;
+
+  if(pipe(fds) < 0)
+    return -1;
+  if((pid = fork()) < 0){
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if(pid == 0){
+    close(fds[1]);
+    if(read(fds[0], &va, sizeof(va)) != sizeof(va) || va == 0)
+      exit(1);
+    produce((struct ring*)va, id, n);
+    exit(0);
+  }
+  close(fds[0]);
+  if((va = map_shared_pages(getpid(), pid, r, RINGBYTES)) == (uint64)-1)
+    va = 0;
+  write(fds[1], &va, sizeof(va));
+  close(fds[1]);
+  return va != 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  static int nprod[] = { 1, 2, 4, 8, 16 };
+  struct ring *r;
+  struct stats s;
+  int i, j, k, n, np, nrun, t0, t;
+  char *mem;
+
+  n = 20000;
+  if(argc > 1)
+    n = atoi(argv[1]);
+
+  mem = sbrk(RINGBYTES);
+  if(mem == (char*)-1){
+    printf("ringbench: sbrk failed\n");
+    exit(1);
+  }
+
+  for(i = 0; i < sizeof(nprod)/sizeof(nprod[0]); i++){
+    np = nprod[i];
+    r = ring_init(mem, RINGBYTES);
+    t0 = uptime();
+    for(nrun = j = 0; j < np; j++){
+      if((k = forkproducer(r, j, n)) < 0){
+        printf("ringbench: fork failed\n");
+        exit(1);
+      }
+      nrun += k;
+    }
+    s.n = s.bad = 0;
+    while(s.n < nrun*n)
+      ring_consume(r, check, &s, BATCH);
+    t = uptime() - t0;
+    for(j = 0; j < np; j++)
+      wait(0);
+    printf("ringbench: %d producers: %d records in %d ticks", np, s.n, t);
+    if(t > 0)
+      printf(", %d records/tick", s.n / t);
+    if(s.bad)
+      printf(", %d bad", s.bad);
+    if(nrun < np)
+      printf(", %d couldn't map the ring", np - nrun);
+    printf("\n");
+  }
+  exit(0);
+}
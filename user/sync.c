@@ -0,0 +1,91 @@
+// Mutexes, condition variables and blocking queues that
+// sleep in the kernel with futex_wait() instead of spinning.
+// They hold no pointers, so they work between threads, and
+// also between processes when they lie in memory shared with
+// map_shared_pages() or shm_attach(). All-zero bytes are an
+// unlocked mutex, a condition variable and an empty queue.
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+// m->val is 0 when unlocked, 1 when locked, and 2 when
+// locked and someone may be waiting, so that unlocking only
+// costs a system call when it might wake someone.
+void
+mutex_lock(struct mutex *m)
+{
+  uint c;
+
+  if((c = __sync_val_compare_and_swap(&m->val, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = __atomic_exchange_n(&m->val, 2, __ATOMIC_ACQUIRE);
+  while(c != 0){
+    futex_wait(&m->val, 2);
+    c = __atomic_exchange_n(&m->val, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+  if(__sync_fetch_and_sub(&m->val, 1) != 1){
+    __atomic_store_n(&m->val, 0, __ATOMIC_RELEASE);
+    futex_wake(&m->val, 1);
+  }
+}
+
+// Release m, wait for cond_signal() or cond_broadcast() on c,
+// and lock m again. May return early, so callers must check
+// their condition in a loop.
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+  uint seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+
+  mutex_unlock(m);
+  // returns at once if there was a signal since seq was read.
+  futex_wait(&c->seq, seq);
+  mutex_lock(m);
+}
+
+void
+cond_signal(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 1);
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+  __sync_fetch_and_add(&c->seq, 1);
+  futex_wake(&c->seq, 0x7fffffff);
+}
+
+// Add x to q, waiting while it's full.
+void
+queue_put(struct queue *q, uint64 x)
+{
+  mutex_lock(&q->lock);
+  while(q->tail - q->head == QUEUESIZE)
+    cond_wait(&q->notfull, &q->lock);
+  q->item[q->tail++ % QUEUESIZE] = x;
+  cond_signal(&q->notempty);
+  mutex_unlock(&q->lock);
+}
+
+// Take the oldest item from q, waiting while it's empty.
+uint64
+queue_get(struct queue *q)
+{
+  uint64 x;
+
+  mutex_lock(&q->lock);
+  while(q->tail == q->head)
+    cond_wait(&q->notempty, &q->lock);
+  x = q->item[q->head++ % QUEUESIZE];
+  cond_signal(&q->notfull);
+  mutex_unlock(&q->lock);
+  return x;
+}
@@ -0,0 +1,68 @@
+// User-level threads, on top of the clone() and join()
+// system calls. Threads share the process's memory, but
+// each has its own stack, allocated here with malloc(),
+// and its own copies of the open file descriptors.
+// malloc() and free() are not thread-safe: only one thread
+// at a time may call them, or thread_create() and
+// thread_join(), which use them.
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define TSTACK 8192  // bytes of stack for each thread
+
+// where every thread starts; t must stay put until
+// thread_join(t).
+static void
+threadstart(void *arg)
+{
+  struct thread *t = arg;
+
+  t->fn(t->arg);
+  exit(0);
+}
+
+// Start a thread running fn(arg), described by t.
+// Returns 0, or -1 if the thread can't be created.
+int
+thread_create(struct thread *t, void (*fn)(void*), void *arg)
+{
+  // malloc() returns 16-byte aligned memory, as the
+  // riscv calling convention wants for sp.
+  if((t->stack = malloc(TSTACK)) == 0)
+    return -1;
+  t->fn = fn;
+  t->arg = arg;
+  t->tid = clone(threadstart, t, (char*)t->stack + TSTACK);
+  if(t->tid < 0){
+    free(t->stack);
+    return -1;
+  }
+  return 0;
+}
+
+// Wait for thread t to return or call exit(), and free
+// its stack. Returns 0, or -1.
+int
+thread_join(struct thread *t)
+{
+  if(join(t->tid) < 0)
+    return -1;
+  free(t->stack);
+  return 0;
+}
+
+void
+thread_lock(struct tlock *l)
+{
+  while(__sync_lock_test_and_set(&l->locked, 1) != 0)
+    ;
+  __sync_synchronize();
+}
+
+void
+thread_unlock(struct tlock *l)
+{
+  __sync_synchronize();
+  __sync_lock_release(&l->locked);
+}
@@ -1,4 +1,6 @@
 struct stat;
+struct lockstat;
+struct bstat;
 
 // system calls
 int fork(void);
@@ -26,6 +28,18 @@ int uptime(void);
 uint64 map_shared_pages(int src_pid, int dst_pid, void* src_va, uint64 size);
 uint64 unmap_shared_pages(void* addr, uint64 size);
 int getppid(void);
+int shm_open(int key, uint64 size);
+void* shm_attach(int id, void *va);
+int shm_detach(void *va);
+int lockstat(int i, struct lockstat *ls, int reset);
+int setpriority(int pid, int nice);
+int clone(void (*fn)(void*), void *arg, void *stack);
+int join(int tid);
+int futex_wait(uint *addr, uint expected);
+int futex_wake(uint *addr, int n);
+int bstat(struct bstat *st);
+int setreadahead(int n);
+int dropcache(void);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -43,3 +57,41 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// thread.c
+struct thread {
+  int tid;
+  void *stack;
+  void (*fn)(void*);
+  void *arg;
+};
+struct tlock {
+  uint locked;
+};
+int thread_create(struct thread*, void (*)(void*), void*);
+int thread_join(struct thread*);
+void thread_lock(struct tlock*);
+void thread_unlock(struct tlock*);
+
+// sync.c
+struct mutex {
+  uint val;
+};
+struct cond {
+  uint seq;
+};
+#define QUEUESIZE 64
+struct queue {
+  struct mutex lock;
+  struct cond notempty;
+  struct cond notfull;
+  uint head, tail;
+  uint64 item[QUEUESIZE];
+};
+void mutex_lock(struct mutex*);
+void mutex_unlock(struct mutex*);
+void cond_wait(struct cond*, struct mutex*);
+void cond_signal(struct cond*);
+void cond_broadcast(struct cond*);
+void queue_put(struct queue*, uint64);
+uint64 queue_get(struct queue*);
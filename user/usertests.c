@@ -2,11 +2,14 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
+#include "user/ring.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/bstat.h"
+#include "kernel/lockstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -1921,9 +1924,10 @@ dirfile(char *s)
 void
 iref(char *s)
 {
+  enum { N = 51 };
   int i, fd;
 
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     if(mkdir("irefd") != 0){
       printf("%s: mkdir irefd failed\n", s);
       exit(1);
@@ -1945,7 +1949,7 @@ iref(char *s)
   }
 
   // clean up
-  for(i = 0; i < NINODE + 1; i++){
+  for(i = 0; i < N; i++){
     chdir("..");
     unlink("irefd");
   }
@@ -1993,6 +1997,311 @@ forktest(char *s)
   }
 }
 
+// lots of short-lived children, many more at once than the
+// old fixed-size process table held.
+void
+manyforks(char *s)
+{
+  enum { N = 1200, BATCH = 200 };
+  int i, j, pid, xstatus;
+
+  for(i = 0; i < N; i += BATCH){
+    for(j = 0; j < BATCH; j++){
+      pid = fork();
+      if(pid < 0){
+        printf("%s: fork %d failed\n", s, i + j);
+        exit(1);
+      }
+      if(pid == 0)
+        exit(j % 7);
+    }
+    for(j = 0; j < BATCH; j++){
+      if(wait(&xstatus) < 0){
+        printf("%s: wait stopped early\n", s);
+        exit(1);
+      }
+      if(xstatus < 0 || xstatus >= 7){
+        printf("%s: bad exit status %d\n", s, xstatus);
+        exit(1);
+      }
+    }
+  }
+  if(wait(0) != -1){
+    printf("%s: wait got too many\n", s);
+    exit(1);
+  }
+}
+
+// do parent and child each see their own copy of memory
+// after a (copy-on-write) fork?
+void
+cowfork(char *s)
+{
+  enum { N = 64*PGSIZE };
+  char *a;
+  int i, pid, xstatus, fds[2];
+
+  a = sbrk(N);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i += PGSIZE)
+    a[i] = 'p';
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < N; i += PGSIZE){
+      if(a[i] != 'p'){
+        printf("%s: child saw %x, not parent's data\n", s, a[i]);
+        exit(1);
+      }
+      a[i] = 'c';
+    }
+    // the kernel writes into copy-on-write pages too.
+    if(read(fds[0], a + PGSIZE, 1) != 1 || a[PGSIZE] != 'x')
+      exit(1);
+    exit(0);
+  }
+  write(fds[1], "x", 1);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(i = 0; i < N; i += PGSIZE){
+    if(a[i] != 'p'){
+      printf("%s: parent saw child's write\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// how long does fork()+exit()+wait() take as the parent grows?
+// with copy-on-write fork the cost should barely depend on size.
+void
+forklatency(char *s)
+{
+  enum { N = 50 };
+  int sizes[] = { 0, 256, 1024, 4096 }; // pages
+  int i, j, pid, t0;
+  char *a;
+
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    a = sbrk(sizes[i]*PGSIZE);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < sizes[i]; j++)
+      a[j*PGSIZE] = 1;
+
+    t0 = uptime();
+    for(j = 0; j < N; j++){
+      pid = fork();
+      if(pid < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid == 0)
+        exit(0);
+      wait(0);
+    }
+    printf("%d pages: %d forks in %d ticks; ", sizes[i], N, uptime() - t0);
+
+    sbrk(-sizes[i]*PGSIZE);
+  }
+}
+
+// context-switch throughput: pairs of processes bounce a byte
+// back and forth over pipes, so every round trip is two
+// switches. run with 1, 3 and 8 pairs; boot with CPUS=1, 3 or 8
+// to see how throughput scales with the number of harts.
+void
+ctxswitch(char *s)
+{
+  enum { N = 500 };
+  int npairs[] = { 1, 3, 8 };
+  int i, j, k, t0, pid, xstatus;
+  int ping[2], pong[2];
+  char c;
+
+  for(i = 0; i < sizeof(npairs)/sizeof(npairs[0]); i++){
+    t0 = uptime();
+    for(j = 0; j < npairs[i]; j++){
+      pid = fork();
+      if(pid < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pid > 0)
+        continue;
+      if(pipe(ping) < 0 || pipe(pong) < 0){
+        printf("%s: pipe failed\n", s);
+        exit(1);
+      }
+      pid = fork();
+      if(pid < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      for(k = 0; k < N; k++){
+        if(pid == 0){
+          if(read(ping[0], &c, 1) != 1 || write(pong[1], &c, 1) != 1)
+            exit(1);
+        } else {
+          if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1){
+            printf("%s: ping-pong failed\n", s);
+            exit(1);
+          }
+        }
+      }
+      if(pid == 0)
+        exit(0);
+      wait(&xstatus);
+      exit(xstatus);
+    }
+    for(j = 0; j < npairs[i]; j++){
+      wait(&xstatus);
+      if(xstatus != 0)
+        exit(xstatus);
+    }
+    printf("%d pairs: %d switches in %d ticks; ", npairs[i], 2*N*npairs[i], uptime() - t0);
+  }
+}
+
+static void
+spin(void)
+{
+  for(volatile int i = 0; i < 10000; i++)
+    ;
+}
+
+// a CPU-bound reader, like log_test's parent draining the
+// log, competing with spinning writers should get its work
+// done sooner when its nice value gives it more weight.
+// Timing under QEMU varies too much to fail on, so this only
+// reports the two times.
+void
+nicelatency(char *s)
+{
+  enum { NSPIN = 6 };
+  int nices[] = { 0, -10 };
+  int pids[NSPIN], t[2];
+  int i, j, n, t0;
+
+  // how much work takes 5 ticks with the CPU to ourselves?
+  t0 = uptime();
+  while(uptime() == t0)
+    ;
+  t0 = uptime();
+  for(n = 0; uptime() < t0 + 5; n++)
+    spin();
+
+  for(i = 0; i < 2; i++){
+    for(j = 0; j < NSPIN; j++){
+      pids[j] = fork();
+      if(pids[j] < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pids[j] == 0){
+        setpriority(0, 0);
+        for(;;)
+          spin();
+      }
+    }
+    if(setpriority(0, nices[i]) < 0){
+      printf("%s: setpriority failed\n", s);
+      exit(1);
+    }
+    t0 = uptime();
+    for(j = 0; j < n; j++)
+      spin();
+    t[i] = uptime() - t0;
+    setpriority(0, 0);
+    for(j = 0; j < NSPIN; j++){
+      kill(pids[j]);
+      wait(0);
+    }
+  }
+
+  printf("nice 0: %d ticks, nice -10: %d ticks; ", t[0], t[1]);
+  if(setpriority(0, NICEMAX + 1) != -1 || setpriority(0, NICEMIN - 1) != -1){
+    printf("%s: setpriority accepted a bad nice value\n", s);
+    exit(1);
+  }
+}
+
+// pipe ping-pong with and without lots of other processes
+// asleep. wakeup() only looks at processes sleeping on
+// channels that hash like its own, so the sleepers
+// shouldn't slow the ping-pong down.
+void
+wakeupscale(char *s)
+{
+  enum { N = 1000, NSLEEP = NPROC/2 };
+  int nsleep[] = { 0, NSLEEP };
+  int pids[NSLEEP], ping[2], pong[2];
+  int i, j, pid, t0, xstatus;
+  char c = 0;
+
+  for(i = 0; i < 2; i++){
+    for(j = 0; j < nsleep[i]; j++){
+      pids[j] = fork();
+      if(pids[j] < 0){
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if(pids[j] == 0){
+        for(;;)
+          sleep(1000);
+      }
+    }
+    if(pipe(ping) < 0 || pipe(pong) < 0){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    t0 = uptime();
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    for(j = 0; j < N; j++){
+      if(pid == 0){
+        if(read(ping[0], &c, 1) != 1 || write(pong[1], &c, 1) != 1)
+          exit(1);
+      } else if(write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1){
+        printf("%s: ping-pong failed\n", s);
+        exit(1);
+      }
+    }
+    if(pid == 0)
+      exit(0);
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+    printf("%d sleepers: %d round trips in %d ticks; ", nsleep[i], N, uptime() - t0);
+    close(ping[0]);
+    close(ping[1]);
+    close(pong[0]);
+    close(pong[1]);
+    for(j = 0; j < nsleep[i]; j++){
+      kill(pids[j]);
+      wait(0);
+    }
+  }
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2057,6 +2366,768 @@ sbrkbasic(char *s)
   exit(xstatus);
 }
 
+// can two processes share memory through a named segment,
+// without knowing each other's pids? is the segment freed
+// after the last detach, or when its opener exits?
+void
+shmseg(char *s)
+{
+  enum { KEY = 0x5eed, SZ = 3*PGSIZE };
+  int id, pid, xstatus;
+  char *a, *b;
+
+  if((id = shm_open(KEY, SZ)) < 0){
+    printf("%s: shm_open failed\n", s);
+    exit(1);
+  }
+  a = shm_attach(id, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: shm_attach failed\n", s);
+    exit(1);
+  }
+  strcpy(a + 2*PGSIZE, "parent");
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // forget the inherited attachment and find the
+    // segment by key, at an address of our choosing.
+    shm_detach(a);
+    b = (char*)PGROUNDUP((uint64)sbrk(0) + 16*PGSIZE);
+    if(shm_attach(shm_open(KEY, SZ), b) != b)
+      exit(1);
+    if(strcmp(b + 2*PGSIZE, "parent") != 0)
+      exit(2);
+    strcpy(b, "child");
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child failed %d\n", s, xstatus);
+    exit(1);
+  }
+  if(strcmp(a, "child") != 0){
+    printf("%s: parent didn't see child's write\n", s);
+    exit(1);
+  }
+  if(shm_detach(a) != 0 || shm_detach(a) != -1){
+    printf("%s: shm_detach failed\n", s);
+    exit(1);
+  }
+
+  // the last detach freed it; a new one starts out zero.
+  id = shm_open(KEY, SZ);
+  a = shm_attach(id, 0);
+  if(a == (char*)0xffffffffffffffffL || a[0] != 0){
+    printf("%s: segment not freed on last detach\n", s);
+    exit(1);
+  }
+  shm_detach(a);
+
+  // segments opened but never attached go away when their
+  // openers exit, so they can't fill up the table.
+  for(int i = 0; i < 2*NSHM; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0)
+      exit(shm_open(KEY + 1 + i, PGSIZE) < 0);
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: shm_open of unattached segment %d failed\n", s, i);
+      exit(1);
+    }
+  }
+}
+
+// map_shared_pages() and kill() on processes that are exiting
+// or gone: findproc() mustn't hand back a reused proc.
+void
+pidreuse(char *s)
+{
+  enum { N = 200 };
+  char *buf = sbrk(PGSIZE);
+  int i, pid, me = getpid();
+
+  for(i = 0; i < N; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0)
+      exit(0);
+    // the child may or may not have exited yet.
+    map_shared_pages(me, pid, buf, PGSIZE);
+    kill(pid);
+    wait(0);
+    if(kill(pid) != -1){
+      printf("%s: kill of a dead pid succeeded\n", s);
+      exit(1);
+    }
+    if(map_shared_pages(me, pid, buf, PGSIZE) != (uint64)-1){
+      printf("%s: map_shared_pages to a dead pid succeeded\n", s);
+      exit(1);
+    }
+  }
+  if(getppid() <= 0){
+    printf("%s: getppid failed\n", s);
+    exit(1);
+  }
+}
+
+// threads share memory: they sum slices of one array in
+// parallel, and bump a counter under a lock. when the first
+// thread exits, the others must go too.
+enum { NTHR = 4, NSUM = 4096, NBUMP = 10000 };
+static int thrdata[NSUM];
+static int thrsum[NTHR];
+static int thrcount;
+static struct tlock thrlock;
+
+static void
+thrwork(void *arg)
+{
+  int i, id = (int)(uint64)arg;
+
+  for(i = id * NSUM/NTHR; i < (id+1) * NSUM/NTHR; i++)
+    thrsum[id] += thrdata[i];
+  for(i = 0; i < NBUMP; i++){
+    thread_lock(&thrlock);
+    thrcount++;
+    thread_unlock(&thrlock);
+  }
+}
+
+static void
+thrspin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+void
+threads(char *s)
+{
+  struct thread t[NTHR];
+  int i, sum = 0, pid, xstatus;
+
+  for(i = 0; i < NSUM; i++)
+    thrdata[i] = i;
+  for(i = 0; i < NTHR; i++){
+    if(thread_create(&t[i], thrwork, (void*)(uint64)i) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NTHR; i++){
+    if(thread_join(&t[i]) < 0){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+    sum += thrsum[i];
+  }
+  if(sum != NSUM*(NSUM-1)/2 || thrcount != NTHR*NBUMP){
+    printf("%s: sum %d count %d\n", s, sum, thrcount);
+    exit(1);
+  }
+  if(join(t[0].tid) != -1){
+    printf("%s: joined a thread twice\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(i = 0; i < 2; i++)
+      if(thread_create(&t[i], thrspin, 0) < 0)
+        exit(1);
+    if(exec("echo", 0) != -1)
+      exit(1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: threaded child failed\n", s);
+    exit(1);
+  }
+}
+
+// futex-based mutexes and queues, between threads and
+// between processes that share a page.
+enum { NQUEUED = 1000 };
+static struct mutex futmutex;
+static struct queue futqueue;
+static int futcount;
+
+static void
+futbump(void *arg)
+{
+  for(int i = 0; i < NBUMP; i++){
+    mutex_lock(&futmutex);
+    futcount++;
+    mutex_unlock(&futmutex);
+  }
+}
+
+static void
+futproduce(void *arg)
+{
+  for(int i = 1; i <= NQUEUED; i++)
+    queue_put(&futqueue, i);
+}
+
+static uint futword;
+
+static void
+futsleep(void *arg)
+{
+  uint *w = arg ? arg : &futword;
+
+  while(__atomic_load_n(w, __ATOMIC_SEQ_CST) == 0)
+    futex_wait(w, 0);
+}
+
+void
+futex(char *s)
+{
+  struct thread t[NTHR];
+  struct queue *q;
+  uint x = 7, *w;
+  int i, pid, fds[2], xstatus;
+  uint64 sum;
+  char c;
+
+  if(futex_wait(&x, 8) != -1 || futex_wake(&x, 1) != 0){
+    printf("%s: futex on a changed word\n", s);
+    exit(1);
+  }
+
+  for(i = 0; i < NTHR; i++){
+    if(thread_create(&t[i], futbump, 0) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NTHR; i++)
+    thread_join(&t[i]);
+  if(futcount != NTHR*NBUMP){
+    printf("%s: count %d, not %d\n", s, futcount, NTHR*NBUMP);
+    exit(1);
+  }
+
+  // a fork while a thread waits makes the word's page
+  // copy-on-write, and the store below moves it to a new
+  // frame; the wake must still find the waiter.
+  if(thread_create(&t[0], futsleep, 0) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  sleep(1);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  wait(0);
+  __atomic_store_n(&futword, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&futword, 1);
+  thread_join(&t[0]);
+
+  // a thread waits on a private word, and only then does a
+  // child map the word's page and wake it.
+  w = (uint*)sbrk(PGSIZE);
+  *w = 0;
+  if(thread_create(&t[0], futsleep, w) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  sleep(1);
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    uint *cw = (uint*)map_shared_pages(getppid(), getpid(), w, sizeof(*w));
+    if(cw == (uint*)-1)
+      exit(1);
+    __atomic_store_n(cw, 1, __ATOMIC_SEQ_CST);
+    futex_wake(cw, 1);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child couldn't map the word\n", s);
+    exit(1);
+  }
+  thread_join(&t[0]);
+
+  if(thread_create(&t[0], futproduce, 0) < 0){
+    printf("%s: thread_create failed\n", s);
+    exit(1);
+  }
+  for(sum = 0, i = 0; i < NQUEUED; i++)
+    sum += queue_get(&futqueue);
+  thread_join(&t[0]);
+  if(sum != NQUEUED*(NQUEUED+1)/2){
+    printf("%s: threads queued sum %d\n", s, (int)sum);
+    exit(1);
+  }
+
+  // the child maps the parent's queue, then produces into it.
+  q = (struct queue*)sbrk(PGSIZE);
+  memset(q, 0, PGSIZE);
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    q = (struct queue*)map_shared_pages(getppid(), getpid(), q, PGSIZE);
+    if(q == (struct queue*)-1)
+      exit(1);
+    write(fds[1], "x", 1);
+    for(i = 1; i <= NQUEUED; i++)
+      queue_put(q, i);
+    exit(0);
+  }
+  close(fds[1]);
+  if(read(fds[0], &c, 1) != 1){
+    printf("%s: child couldn't map the queue\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  for(sum = 0, i = 0; i < NQUEUED; i++)
+    sum += queue_get(q);
+  wait(&xstatus);
+  if(sum != NQUEUED*(NQUEUED+1)/2 || xstatus != 0){
+    printf("%s: processes queued sum %d\n", s, (int)sum);
+    exit(1);
+  }
+}
+
+// two producer threads, one publishing in batches, fill a
+// small ring many times over; are records whole and in order?
+enum { NRINGREC = 5000 };
+static struct ring *ringr;
+static int ringseq[2];
+static int ringbad;
+
+static void
+ringfill(int id, int seq, char *rec)
+{
+  int len = 8 + seq % 40;
+
+  memmove(rec, &seq, sizeof(seq));
+  memset(rec + sizeof(seq), id, len - sizeof(seq));
+}
+
+static void
+ringproduce(void *arg)
+{
+  int id = (int)(uint64)arg, seq, i;
+  char rec[4][48];
+  struct ringvec v[4];
+
+  for(seq = 0; seq < NRINGREC; seq += 4){
+    for(i = 0; i < 4; i++){
+      ringfill(id, seq + i, rec[i]);
+      v[i].buf = rec[i];
+      v[i].len = 8 + (seq + i) % 40;
+    }
+    if(id == 0){
+      while(ring_putv(ringr, v, 4) < 0)
+        ;
+    } else {
+      for(i = 0; i < 4; i++)
+        while(ring_put(ringr, v[i].buf, v[i].len) < 0)
+          ;
+    }
+  }
+}
+
+static void
+ringcheck(void *arg, void *rec, uint len)
+{
+  char want[48];
+  int seq, id;
+
+  memmove(&seq, rec, sizeof(seq));
+  id = ((char*)rec)[len-1];
+  if(id < 0 || id > 1 || seq != ringseq[id]){
+    ringbad++;
+    return;
+  }
+  ringfill(id, seq, want);
+  if(len != 8 + seq % 40 || memcmp(rec, want, len) != 0)
+    ringbad++;
+  ringseq[id]++;
+}
+
+static void
+ringnop(void *arg, void *rec, uint len)
+{
+}
+
+void
+ring(char *s)
+{
+  static uint64 full[(sizeof(struct ring) + 64) / 8];
+  struct ring *r;
+  struct thread t[2];
+  char buf[48];
+  int i, n;
+
+  if((ringr = ring_init(malloc(1024), 1024)) == 0){
+    printf("%s: ring_init failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 2; i++){
+    if(thread_create(&t[i], ringproduce, (void*)(uint64)i) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(n = 0; n < 2*NRINGREC; )
+    n += ring_consume(ringr, ringcheck, 0, 16);
+  for(i = 0; i < 2; i++)
+    thread_join(&t[i]);
+  if(ringbad || ring_get(ringr, buf, sizeof(buf)) != -1){
+    printf("%s: %d bad records\n", s, ringbad);
+    exit(1);
+  }
+
+  // an exactly full ring gives up each record once.
+  r = ring_init(full, sizeof(struct ring) + 64);
+  for(i = 0; i < 4; i++){
+    if(ring_put(r, "01234567", 8) < 0){
+      printf("%s: ring_put failed\n", s);
+      exit(1);
+    }
+  }
+  if(ring_put(r, "x", 1) != -1 || ring_consume(r, ringnop, 0, 16) != 4 ||
+     ring_get(r, buf, sizeof(buf)) != -1){
+    printf("%s: full ring mishandled\n", s);
+    exit(1);
+  }
+  if(ring_put(r, buf, 40) != -1){
+    printf("%s: ring took a record bigger than half of it\n", s);
+    exit(1);
+  }
+}
+
+// are locks made after boot, however many, still reported
+// by lockstat()?
+void
+lockclasses(char *s)
+{
+  static char *names[] = { "proc", "pipe", "virtio_disk", "sleep lock" };
+  struct lockstat ls;
+  int fds[2], found, i, j;
+
+  if(pipe(fds) < 0 || write(fds[1], "x", 1) != 1){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(names)/sizeof(names[0]); i++){
+    found = 0;
+    for(j = 0; lockstat(j, &ls, 0) == 0; j++){
+      if(strcmp(ls.name, names[i]) == 0 && ls.nlock > 0 && ls.nacquire > 0)
+        found = 1;
+    }
+    if(!found){
+      printf("%s: no %s locks reported\n", s, names[i]);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// does re-reading a small file hit in the buffer cache?
+void
+bcachestat(char *s)
+{
+  static char buf[BSIZE];
+  struct bstat st0, st;
+  int fd, i, j;
+
+  if((fd = open("bcachestat", O_CREATE | O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4; i++)
+    write(fd, buf, sizeof(buf));
+  close(fd);
+
+  bstat(&st0);
+  if(st0.nbuf < NBUF){
+    printf("%s: only %d buffers\n", s, st0.nbuf);
+    exit(1);
+  }
+  for(j = 0; j < 10; j++){
+    if((fd = open("bcachestat", O_RDONLY)) < 0){
+      printf("%s: open failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < 4; i++){
+      if(read(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf("%s: read failed\n", s);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+  bstat(&st);
+  unlink("bcachestat");
+
+  // the file's blocks were all written just now, so none
+  // of them should have needed reading from the disk.
+  if(st.hits - st0.hits < 40 || st.misses - st0.misses > 4){
+    printf("%s: %d hits, %d misses\n", s,
+           (int)(st.hits - st0.hits), (int)(st.misses - st0.misses));
+    exit(1);
+  }
+}
+
+// do sequential reads of a file that isn't cached read
+// ahead, in merged disk requests, and still see the right data?
+void
+readahead(char *s)
+{
+  enum { N = 20 };
+  static char buf[BSIZE];
+  struct bstat st0, st;
+  int fd, i, old;
+
+  if((fd = open("readahead", O_CREATE | O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a' + i, sizeof(buf));
+    write(fd, buf, sizeof(buf));
+  }
+  close(fd);
+
+  old = setreadahead(4);
+  dropcache();
+  bstat(&st0);
+  if((fd = open("readahead", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) ||
+       buf[0] != 'a' + i || buf[BSIZE-1] != 'a' + i){
+      printf("%s: block %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  bstat(&st);
+  setreadahead(old);
+  unlink("readahead");
+
+  if(st.readaheads == st0.readaheads){
+    printf("%s: nothing read ahead\n", s);
+    exit(1);
+  }
+  // blocks read ahead together should share disk requests.
+  if(st.diskblocks - st0.diskblocks <= st.diskreqs - st0.diskreqs){
+    printf("%s: %d blocks in %d disk requests\n", s,
+           (int)(st.diskblocks - st0.diskblocks), (int)(st.diskreqs - st0.diskreqs));
+    exit(1);
+  }
+}
+
+// do shared mappings live in the mmap area, leaving the heap
+// alone, and is address space freed by unmap reused?
+void
+mmapreuse(char *s)
+{
+  enum { N = 4*PGSIZE };
+  char *src, *a, *b, *c, *brk;
+  int i, pid = getpid();
+
+  src = sbrk(N);
+  brk = sbrk(0);
+  for(i = 0; i < N; i += PGSIZE)
+    src[i] = 'a' + i/PGSIZE;
+
+  a = (char*)map_shared_pages(pid, pid, src, N);
+  b = (char*)map_shared_pages(pid, pid, src, N);
+  c = (char*)map_shared_pages(pid, pid, src, N);
+  if(a == (char*)-1 || b == (char*)-1 || c == (char*)-1){
+    printf("%s: map_shared_pages failed\n", s);
+    exit(1);
+  }
+  if(sbrk(0) != brk || a < brk){
+    printf("%s: mapping moved the heap\n", s);
+    exit(1);
+  }
+  if(b[2*PGSIZE] != 'c'){
+    printf("%s: mapping has the wrong contents\n", s);
+    exit(1);
+  }
+
+  // a hole in the middle gets reused.
+  if(unmap_shared_pages(b, N) != 0){
+    printf("%s: unmap_shared_pages failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 1000; i++){
+    char *d = (char*)map_shared_pages(pid, pid, src, N);
+    if(d != b){
+      printf("%s: address space not reused %p %p\n", s, d, b);
+      exit(1);
+    }
+    if(unmap_shared_pages(d, N) != 0){
+      printf("%s: unmap_shared_pages failed\n", s);
+      exit(1);
+    }
+  }
+
+  // the source and all the mappings share the pages.
+  c[0] = 'z';
+  if(src[0] != 'z' || a[0] != 'z'){
+    printf("%s: mapping not shared\n", s);
+    exit(1);
+  }
+  if(unmap_shared_pages(a, N) != 0 || unmap_shared_pages(c, N) != 0)
+    exit(1);
+}
+
+// does sbrk() hand out pages lazily? a huge sbrk() should
+// succeed, untouched pages should read as zero, and system
+// calls should be able to use them.
+void
+lazyalloc(char *s)
+{
+  enum { BIG=1024*1024*1024 };
+  char *a, *p;
+  int fds[2];
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: lazy sbrk(%d) failed\n", s, BIG);
+    exit(1);
+  }
+  for(p = a; p < a + BIG; p += BIG/16){
+    if(*p != 0){
+      printf("%s: fresh page not zero\n", s);
+      exit(1);
+    }
+    *p = 1;
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  p = a + BIG - 2*PGSIZE;
+  write(fds[1], "lazy", 5);
+  if(read(fds[0], p, 5) != 5 || strcmp(p, "lazy") != 0){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + BIG/2 + PGSIZE, 10) != 10){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if(sbrk(-BIG) != a + BIG){
+    printf("%s: sbrk(-BIG) failed\n", s);
+    exit(1);
+  }
+}
+
+// a big enough heap is mapped with 2-megabyte superpages.
+// check that copy-on-write, sharing, and shrinking the heap
+// into the middle of one all preserve its contents.
+void
+superpage(char *s)
+{
+  enum { SUPER=2*1024*1024 };
+  char *top, *a, *p, *q;
+  int pid, xstatus;
+  uint64 addr;
+
+  top = sbrk(0);
+  a = (char*)(((uint64)top + SUPER - 1) & ~(SUPER - 1));
+  if(sbrk(a + 2*SUPER - top) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + 2*SUPER; p += PGSIZE)
+    *p = (p - a) / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[SUPER/2] = 'c';
+    for(p = a; p < a + 2*SUPER; p += PGSIZE){
+      if(p != a + SUPER/2 && *p != (char)((p - a) / PGSIZE)){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(a[SUPER/2] != (char)(SUPER/2/PGSIZE)){
+    printf("%s: child's store leaked into parent\n", s);
+    exit(1);
+  }
+
+  addr = map_shared_pages(getpid(), getpid(), a, 2*SUPER);
+  if(addr == -1){
+    printf("%s: map_shared_pages failed\n", s);
+    exit(1);
+  }
+  q = (char*)addr;
+  q[PGSIZE] = 'x';
+  if(a[PGSIZE] != 'x' || q[SUPER + PGSIZE] != (char)(SUPER/PGSIZE + 1)){
+    printf("%s: shared mapping is wrong\n", s);
+    exit(1);
+  }
+  if(unmap_shared_pages(q, 2*SUPER) != 0){
+    printf("%s: unmap_shared_pages failed\n", s);
+    exit(1);
+  }
+
+  sbrk(-(SUPER/2));
+  for(p = a + SUPER; p < a + 2*SUPER - SUPER/2; p += PGSIZE){
+    if(*p != (char)((p - a) / PGSIZE)){
+      printf("%s: shrinking the heap lost data\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-(a + 2*SUPER - SUPER/2 - top));
+}
+
 void
 sbrkmuch(char *s)
 {
@@ -2618,7 +3689,24 @@ struct test {
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {manyforks, "manyforks"},
+  {cowfork, "cowfork"},
+  {forklatency, "forklatency"},
+  {ctxswitch, "ctxswitch"},
+  {nicelatency, "nicelatency"},
+  {wakeupscale, "wakeupscale"},
   {sbrkbasic, "sbrkbasic"},
+  {lazyalloc, "lazyalloc"},
+  {superpage, "superpage"},
+  {shmseg, "shmseg"},
+  {mmapreuse, "mmapreuse"},
+  {pidreuse, "pidreuse"},
+  {threads, "threads"},
+  {futex, "futex"},
+  {ring, "ring"},
+  {lockclasses, "lockclasses"},
+  {bcachestat, "bcachestat"},
+  {readahead, "readahead"},
   {sbrkmuch, "sbrkmuch"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
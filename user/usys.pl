@@ -38,4 +38,16 @@ entry("sleep");
 entry("uptime");
 entry("map_shared_pages");
 entry("unmap_shared_pages");
-entry("getppid");
\ No newline at end of file
+entry("getppid");
+entry("shm_open");
+entry("shm_attach");
+entry("shm_detach");
+entry("lockstat");
+entry("setpriority");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("bstat");
+entry("setreadahead");
+entry("dropcache");